@@ -0,0 +1,344 @@
+#include "batch.h"
+#include <cstring>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+void
+RecvBatch::Resize(size_t n, size_t bufsz) {
+    if (n == 0) {
+        n = 1;
+    }
+
+    m_count = n;
+    m_nmsg = 0;
+    m_bufsz = bufsz;
+    m_bufs.assign(n * bufsz, 0);
+    m_segs.clear();
+    m_segs.reserve(n);
+    m_addrs.resize(n);
+    m_addrlens.assign(n, 0);
+#ifdef __linux__
+    m_msgs.resize(n);
+    m_iovs.resize(n);
+    m_ctrl.assign(n * recvCtrlSize, 0);
+    for (size_t i = 0; i < n; i++) {
+        m_iovs[i].iov_base = buf(i);
+        m_iovs[i].iov_len = bufsz;
+    }
+#endif
+}
+
+int
+RecvBatch::SetGRO(int sockfd, bool enable) {
+#if defined(__linux__) && defined(UDP_GRO)
+    int opt = enable ? 1 : 0;
+    int ret = setsockopt(sockfd, SOL_UDP, UDP_GRO, &opt, sizeof(opt));
+    if (ret < 0) {
+        return ret;
+    }
+    m_gro = enable;
+    Resize(m_count, enable ? groBufSize : recvBufSize);
+    return 0;
+#else
+    (void) sockfd;
+    (void) enable;
+    return -1;
+#endif
+}
+
+int
+RecvBatch::SetTimestamps(int sockfd, bool enable) {
+#if defined(__linux__) && defined(SO_TIMESTAMPNS)
+    int opt = enable ? 1 : 0;
+    int ret = setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt));
+    if (ret < 0) {
+        return ret;
+    }
+    m_stamps = enable;
+    return 0;
+#else
+    (void) sockfd;
+    (void) enable;
+    return -1;
+#endif
+}
+
+int
+RecvBatch::SetOverflow(int sockfd, bool enable) {
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+    int opt = enable ? 1 : 0;
+    return setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt));
+#else
+    (void) sockfd;
+    (void) enable;
+    return -1;
+#endif
+}
+
+int
+RecvBatch::Recv(int sockfd) noexcept {
+    m_segs.clear();
+    m_nmsg = 0;
+#ifdef __linux__
+    // msg_namelen, msg_controllen and msg_len are overwritten by the kernel, reset them every round
+    for (size_t i = 0; i < m_count; i++) {
+        auto &hdr = m_msgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &m_addrs[i];
+        hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        hdr.msg_iov = &m_iovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &m_ctrl[i * recvCtrlSize];
+        hdr.msg_controllen = recvCtrlSize;
+        m_msgs[i].msg_len = 0;
+    }
+
+    int n = recvmmsg(sockfd, m_msgs.data(), unsigned(m_count), 0, nullptr);
+    if (n <= 0) {
+        return 0;
+    }
+    m_nmsg = size_t(n);
+
+    for (int i = 0; i < n; i++) {
+        auto &hdr = m_msgs[i].msg_hdr;
+        m_addrlens[i] = hdr.msg_namelen;
+        auto addr = (const struct sockaddr *) &m_addrs[i];
+
+        size_t len = m_msgs[i].msg_len;
+        size_t gso = 0;
+        uint64_t stamp = 0;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr); cm != nullptr; cm = CMSG_NXTHDR(&hdr, cm)) {
+#ifdef UDP_GRO
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int segsz;
+                memcpy(&segsz, CMSG_DATA(cm), sizeof(segsz));
+                gso = size_t(segsz);
+            }
+#endif
+#ifdef SCM_TIMESTAMPNS
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                stamp = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+            }
+#endif
+#ifdef SO_RXQ_OVFL
+            // the socket's drop counter at the time this datagram was queued
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t ovfl;
+                memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+                m_drops += uint32_t(ovfl - m_ovfl);
+                m_ovfl = ovfl;
+            }
+#endif
+        }
+
+        // split a coalesced run back into datagrams, the last one may be shorter,
+        // they all share the arrival time of the run
+        byte *p = buf(size_t(i));
+        if (gso == 0 || gso >= len) {
+            m_segs.push_back(Datagram{p, len, addr, m_addrlens[i], stamp});
+            continue;
+        }
+        for (size_t off = 0; off < len; off += gso) {
+            size_t sz = len - off < gso ? len - off : gso;
+            m_segs.push_back(Datagram{p + off, sz, addr, m_addrlens[i], stamp});
+        }
+    }
+#else
+    while (m_nmsg < m_count) {
+        m_addrlens[m_nmsg] = sizeof(struct sockaddr_storage);
+        ssize_t sz = recvfrom(sockfd, buf(m_nmsg), m_bufsz, 0, (struct sockaddr *) &m_addrs[m_nmsg],
+                              &m_addrlens[m_nmsg]);
+        if (sz <= 0) {
+            break;
+        }
+        m_segs.push_back(Datagram{buf(m_nmsg), size_t(sz), (const struct sockaddr *) &m_addrs[m_nmsg],
+                                  m_addrlens[m_nmsg], 0});
+        m_nmsg++;
+    }
+#endif
+    return int(m_segs.size());
+}
+
+void
+SendBatch::Resize(size_t n, size_t bufsz) {
+    if (n == 0) {
+        n = 1;
+    }
+
+    m_count = n;
+    m_pending = 0;
+    m_bufsz = bufsz;
+    m_bufs.assign(n * bufsz, 0);
+    m_lens.assign(n, 0);
+    m_addrs.resize(n);
+    m_addrlens.assign(n, 0);
+#ifdef __linux__
+    m_msgs.resize(n);
+    m_iovs.resize(n);
+    m_first.resize(n);
+    m_ctrl.assign(n * CMSG_SPACE(sizeof(uint16_t)), 0);
+#endif
+}
+
+bool
+SendBatch::Push(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept {
+    if (m_pending == m_count || len > m_bufsz) {
+        return false;
+    }
+
+    memcpy(data(m_pending), buf, len);
+    m_lens[m_pending] = len;
+    if (addr != nullptr) {
+        memcpy(&m_addrs[m_pending], addr, addrlen);
+        m_addrlens[m_pending] = addrlen;
+    } else {
+        m_addrlens[m_pending] = 0;
+    }
+    m_pending++;
+    return true;
+}
+
+#ifdef __linux__
+// gsoRejected reports errors meaning the kernel or the device can't do UDP_SEGMENT here
+static bool
+gsoRejected(int err) {
+    return err == EIO || err == EINVAL || err == ENOPROTOOPT || err == EOPNOTSUPP;
+}
+
+bool
+SendBatch::sameDest(size_t a, size_t b) const noexcept {
+    return m_addrlens[a] == m_addrlens[b] && memcmp(&m_addrs[a], &m_addrs[b], m_addrlens[a]) == 0;
+}
+
+size_t
+SendBatch::build(size_t start) noexcept {
+    size_t m = 0;
+    size_t i = start;
+    while (i < m_pending) {
+        // with GSO a run of equal-size datagrams to one peer becomes a single message,
+        // only the last segment of a run may be shorter.
+        size_t k = 1;
+        size_t seg = m_lens[i];
+        if (m_gso) {
+            size_t total = seg;
+            while (i + k < m_pending && k < gsoMaxSegments && sameDest(i, i + k) &&
+                   m_lens[i + k] <= seg && total + m_lens[i + k] <= gsoMaxBytes) {
+                total += m_lens[i + k];
+                bool shorter = m_lens[i + k] < seg;
+                k++;
+                if (shorter) {
+                    break;
+                }
+            }
+        }
+
+        auto &hdr = m_msgs[m].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        if (m_addrlens[i] > 0) {
+            hdr.msg_name = &m_addrs[i];
+            hdr.msg_namelen = m_addrlens[i];
+        }
+        hdr.msg_iov = &m_iovs[i];
+        hdr.msg_iovlen = k;
+#ifdef UDP_SEGMENT
+        if (k > 1) {
+            byte *ctrl = &m_ctrl[m * CMSG_SPACE(sizeof(uint16_t))];
+            hdr.msg_control = ctrl;
+            hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gsoSize = uint16_t(seg);
+            memcpy(CMSG_DATA(cm), &gsoSize, sizeof(gsoSize));
+        }
+#endif
+        m_first[m] = i;
+        m++;
+        i += k;
+    }
+    return m;
+}
+#endif
+
+int
+SendBatch::Flush(int sockfd) noexcept {
+    if (m_pending == 0) {
+        return 0;
+    }
+
+    int sent = 0;
+#ifdef __linux__
+    for (size_t i = 0; i < m_pending; i++) {
+        m_iovs[i].iov_base = data(i);
+        m_iovs[i].iov_len = m_lens[i];
+    }
+
+    size_t next = 0; // first datagram not tried yet
+    while (next < m_pending) {
+        size_t nmsg = build(next);
+        size_t done = 0;
+        while (done < nmsg) {
+            int n = sendmmsg(sockfd, &m_msgs[done], unsigned(nmsg - done), 0);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        int err = errno;
+
+        for (size_t k = 0; k < done; k++) {
+            sent += int(m_msgs[k].msg_hdr.msg_iovlen);
+        }
+        if (done == nmsg) {
+            break;
+        }
+
+        // fall back to one datagram per message for good, and retry what is left
+        next = m_first[done];
+        if (m_gso && gsoRejected(err)) {
+            m_gso = false;
+            continue;
+        }
+        if (err == EINTR) {
+            continue;
+        }
+        // a full buffer refuses the rest as well, other errors (EMSGSIZE, ECONNREFUSED,
+        // EHOSTUNREACH...) belong to this message only, e.g. to one peer of a listener
+        if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS) {
+            m_fullDrops += m_pending - next;
+            break;
+        }
+        next += m_msgs[done].msg_hdr.msg_iovlen;
+    }
+#else
+    for (size_t i = 0; i < m_pending; i++) {
+        ssize_t n;
+        if (m_addrlens[i] > 0) {
+            n = sendto(sockfd, data(i), m_lens[i], 0, (struct sockaddr *) &m_addrs[i], m_addrlens[i]);
+        } else {
+            n = send(sockfd, data(i), m_lens[i], 0);
+        }
+        if (n >= 0) {
+            sent++;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            m_fullDrops++;
+        }
+    }
+#endif
+    m_drops += m_pending - size_t(sent);
+    m_pending = 0;
+    return sent;
+}
+
+void
+SendBatch::SetGSO(bool enable) noexcept {
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    m_gso = enable;
+#else
+    (void) enable;
+#endif
+}
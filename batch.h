@@ -0,0 +1,181 @@
+#ifndef KCP_BATCH_H
+#define KCP_BATCH_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "galois.h"
+#include "clock.h"
+
+const size_t defaultRecvBatch = 32;     // datagrams per recvmmsg
+const size_t recvBufSize = 2048;        // room for one datagram
+const size_t groBufSize = 65535;        // room for one GRO coalesced run
+const size_t recvCtrlSize = 128;        // cmsg space per received message
+const size_t defaultSendBatch = 64;     // datagrams per sendmmsg
+const size_t sendBufSize = 2048;
+const size_t gsoMaxSegments = 64;       // UDP_MAX_SEGMENTS
+const size_t gsoMaxBytes = 65507;       // max udp payload of one super-buffer
+
+// Datagram is one received datagram, "addr" is the sender.
+struct Datagram {
+    byte *data;
+    size_t len;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    uint64_t stamp;     // kernel arrival time in CLOCK_REALTIME ns, 0 if not stamped
+};
+
+inline uint64_t realtimeNs() {
+    return clockNow();
+}
+
+// queueDelay returns the microseconds "d" waited between its kernel arrival and
+// "now" (see realtimeNs), at least 1 for a stamped datagram and 0 for an unstamped one.
+inline uint32_t queueDelay(const Datagram &d, uint64_t now) {
+    if (d.stamp == 0) {
+        return 0;
+    }
+    if (now <= d.stamp) {
+        return 1;   // the clock stepped back
+    }
+    uint64_t us = (now - d.stamp) / 1000;
+    return us == 0 ? 1 : us > UINT32_MAX ? UINT32_MAX : uint32_t(us);
+}
+
+// RecvBatch receives a batch of datagrams with one recvmmsg into pre-allocated buffers.
+// With GRO enabled a buffer may hold a coalesced run of datagrams, which is split
+// back into single datagrams before they are handed out.
+class RecvBatch {
+public:
+    RecvBatch() = default;
+
+    RecvBatch(const RecvBatch &) = delete;
+
+    RecvBatch &operator=(const RecvBatch &) = delete;
+
+    // Resize allocates room for "n" messages of up to "bufsz" bytes each.
+    void Resize(size_t n, size_t bufsz);
+
+    // Recv reads up to Size() messages from a non-blocking socket,
+    // returns the number of datagrams read, 0 if none is pending.
+    int Recv(int sockfd) noexcept;
+
+    // Full reports whether the last Recv used every message slot, i.e. more may be pending.
+    inline bool Full() const { return m_count > 0 && m_nmsg == m_count; }
+
+    // SetGRO toggles UDP_GRO on "sockfd", receive buffers are grown to hold a whole run.
+    int SetGRO(int sockfd, bool enable);
+
+    // SetTimestamps toggles SO_TIMESTAMPNS on "sockfd", datagrams carry their arrival time then.
+    int SetTimestamps(int sockfd, bool enable);
+
+    // SetOverflow toggles SO_RXQ_OVFL on "sockfd", see Drops.
+    int SetOverflow(int sockfd, bool enable);
+
+    // Drops returns the datagrams the kernel dropped on a full receive queue, as reported
+    // by SO_RXQ_OVFL with the last datagram received. Drops before enabling it count too.
+    inline uint64_t Drops() const { return m_drops; }
+
+    inline size_t Size() const { return m_count; }
+
+    inline size_t BufSize() const { return m_bufsz; }
+
+    // Datagrams returns the datagrams of the last Recv.
+    inline Datagram *Datagrams() { return m_segs.data(); }
+
+private:
+    inline byte *buf(size_t i) { return &m_bufs[i * m_bufsz]; }
+
+    bool m_gro{false};
+    bool m_stamps{false};
+    uint32_t m_ovfl{0};     // last SO_RXQ_OVFL counter, it wraps
+    uint64_t m_drops{0};
+    size_t m_count{0};
+    size_t m_nmsg{0};
+    size_t m_bufsz{0};
+    std::vector<byte> m_bufs;
+    std::vector<Datagram> m_segs;
+    std::vector<struct sockaddr_storage> m_addrs;
+    std::vector<socklen_t> m_addrlens;
+#ifdef __linux__
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovs;
+    std::vector<byte> m_ctrl;   // recvCtrlSize bytes of cmsg space per message
+#endif
+};
+
+// SendBatch queues outgoing datagrams and sends them with one sendmmsg.
+class SendBatch {
+public:
+    SendBatch() = default;
+
+    SendBatch(const SendBatch &) = delete;
+
+    SendBatch &operator=(const SendBatch &) = delete;
+
+    // Resize allocates room for "n" datagrams of up to "bufsz" bytes each, pending datagrams are dropped.
+    void Resize(size_t n, size_t bufsz);
+
+    // Push copies one datagram into the batch, "addr" is nullptr for connected sockets.
+    // Returns false if the batch is full or the datagram is too large.
+    bool Push(const void *data, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept;
+
+    // Flush sends all queued datagrams, returns the number accepted by the kernel.
+    // Datagrams the kernel refuses are dropped, as a failed send() would. A message
+    // failing on its own (e.g. EMSGSIZE) is skipped, a full send buffer drops the rest.
+    int Flush(int sockfd) noexcept;
+
+    inline size_t Pending() const { return m_pending; }
+
+    // Drops returns the datagrams Flush dropped because the kernel refused them.
+    inline uint64_t Drops() const { return m_drops; }
+
+    // FullDrops returns the part of Drops refused with EAGAIN or ENOBUFS, i.e. for want
+    // of send buffer space rather than for the datagram itself (EMSGSIZE, ECONNREFUSED...).
+    inline uint64_t FullDrops() const { return m_fullDrops; }
+
+    inline size_t Size() const { return m_count; }
+
+    inline size_t BufSize() const { return m_bufsz; }
+
+    inline bool Full() const { return m_pending == m_count; }
+
+    // SetGSO toggles UDP generic segmentation offload: consecutive equal-size datagrams
+    // to the same peer are sent as one super-buffer with a UDP_SEGMENT cmsg.
+    // It is switched off for good the first time the kernel rejects it.
+    void SetGSO(bool enable) noexcept;
+
+    inline bool GSO() const { return m_gso; }
+
+private:
+    inline byte *data(size_t i) { return &m_bufs[i * m_bufsz]; }
+
+#ifdef __linux__
+    // build fills m_msgs from datagram "start" on, returns the number of messages
+    size_t build(size_t start) noexcept;
+
+    bool sameDest(size_t a, size_t b) const noexcept;
+#endif
+
+    bool m_gso{false};
+    uint64_t m_drops{0};
+    uint64_t m_fullDrops{0};
+    size_t m_count{0};
+    size_t m_pending{0};
+    size_t m_bufsz{0};
+    std::vector<byte> m_bufs;
+    std::vector<size_t> m_lens;
+    std::vector<struct sockaddr_storage> m_addrs;
+    std::vector<socklen_t> m_addrlens;
+#ifdef __linux__
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovs;
+    std::vector<size_t> m_first;    // first datagram of each message
+    std::vector<byte> m_ctrl;       // one UDP_SEGMENT cmsg per message
+#endif
+};
+
+#endif //KCP_BATCH_H
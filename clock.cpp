@@ -0,0 +1,27 @@
+#include "clock.h"
+#include <time.h>
+
+static SystemClock systemClock;
+
+Clock *g_clock = &systemClock;
+
+uint64_t
+SystemClock::Now() noexcept {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+uint64_t
+SystemClock::Monotonic() noexcept {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+Clock *
+SetClock(Clock *c) noexcept {
+    Clock *old = g_clock;
+    g_clock = c != nullptr ? c : &systemClock;
+    return old == &systemClock ? nullptr : old;
+}
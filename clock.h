@@ -0,0 +1,57 @@
+#ifndef KCP_CLOCK_H
+#define KCP_CLOCK_H
+
+#include <stdint.h>
+
+// Clock is the time source of the library. currentMs, receive delays, latency stamps
+// and EmuLink all ask the clock installed with SetClock, so a simulator can run sessions
+// in virtual time. Only the busy poll spin of EventLoop and its epoll timeouts stay
+// on the system clock.
+class Clock {
+public:
+    virtual ~Clock() {}
+
+    // Now returns nanoseconds since the unix epoch, comparable with kernel receive timestamps.
+    virtual uint64_t Now() noexcept = 0;
+
+    // Monotonic returns nanoseconds from an arbitrary start which never jumps, for timers.
+    virtual uint64_t Monotonic() noexcept = 0;
+};
+
+// SystemClock reads CLOCK_REALTIME and CLOCK_MONOTONIC, it is installed by default.
+class SystemClock : public Clock {
+public:
+    uint64_t Now() noexcept override;
+
+    uint64_t Monotonic() noexcept override;
+};
+
+// ManualClock only moves when told to, e.g. by a discrete-event simulator.
+class ManualClock : public Clock {
+public:
+    explicit ManualClock(uint64_t start) : m_now(start) {}
+
+    inline uint64_t Now() noexcept override { return m_now; }
+
+    inline uint64_t Monotonic() noexcept override { return m_now; }
+
+    inline void Set(uint64_t now) noexcept { m_now = now; }
+
+    inline void Advance(uint64_t ns) noexcept { m_now += ns; }
+
+private:
+    uint64_t m_now;
+};
+
+// SetClock installs "c" for the whole process and returns the previous clock, nullptr
+// restores the system clock. The caller keeps ownership. Install it before creating
+// sessions, it is not synchronized with threads reading it.
+Clock *SetClock(Clock *c) noexcept;
+
+extern Clock *g_clock;
+
+inline uint64_t clockNow() noexcept { return g_clock->Now(); }
+
+inline uint64_t clockMonotonic() noexcept { return g_clock->Monotonic(); }
+
+#endif //KCP_CLOCK_H
@@ -0,0 +1,113 @@
+#ifndef KCP_CORO_H
+#define KCP_CORO_H
+
+// C++20 coroutine front-end for sessions and listeners driven by an EventLoop.
+// The library itself builds as C++11, this header is only usable from C++20 code:
+//
+//   CoTask serve(UDPListener *l) {
+//       for (;;) {
+//           UDPSession *sess = co_await AsyncAccept(l);
+//           echo(sess);
+//       }
+//   }
+//
+//   CoTask echo(UDPSession *sess) {
+//       char buf[4096];
+//       for (;;) {
+//           ssize_t n = co_await AsyncRead(sess, buf, sizeof(buf));
+//           co_await AsyncWrite(sess, buf, size_t(n));
+//       }
+//   }
+//
+// A coroutine suspends instead of polling and is resumed by EventLoop::RunOnce in
+// the round its session gets data, send window or a new session, on the loop thread.
+// Destroying the session or listener a coroutine waits on destroys the coroutine,
+// it is not resumed. coro_echo.cpp is a complete example.
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+#include "eventloop.h"
+#include <coroutine>
+#include <exception>
+
+// CoTask is a detached coroutine, it starts right away and frees itself when done.
+struct CoTask {
+    struct promise_type {
+        CoTask get_return_object() noexcept { return {}; }
+
+        std::suspend_never initial_suspend() noexcept { return {}; }
+
+        std::suspend_never final_suspend() noexcept { return {}; }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+inline void resumeCoroutine(void *frame) {
+    std::coroutine_handle<>::from_address(frame).resume();
+}
+
+// destroyCoroutine frees a coroutine suspended on a session or listener being destroyed,
+// the objects in its frame are destructed as on return.
+inline void destroyCoroutine(void *frame) {
+    std::coroutine_handle<>::from_address(frame).destroy();
+}
+
+inline Waiter coroutineWaiter(std::coroutine_handle<> h) noexcept {
+    return Waiter{h.address(), &resumeCoroutine, &destroyCoroutine};
+}
+
+// ReadAwaiter completes with the result of Read once the session has data.
+struct ReadAwaiter {
+    UDPSession *sess;
+    char *buf;
+    size_t sz;
+
+    bool await_ready() const noexcept { return sess->PeekSize() > 0; }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept { sess->AwaitReadable(coroutineWaiter(h)); }
+
+    ssize_t await_resume() noexcept { return sess->Read(buf, sz); }
+};
+
+// WriteAwaiter completes with the result of Write once kcp has send window space.
+struct WriteAwaiter {
+    UDPSession *sess;
+    const char *buf;
+    size_t sz;
+
+    bool await_ready() const noexcept { return sess->Writable(); }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept { sess->AwaitWritable(coroutineWaiter(h)); }
+
+    ssize_t await_resume() noexcept { return sess->Write(buf, sz); }
+};
+
+// AcceptAwaiter completes with the next new session of the listener.
+struct AcceptAwaiter {
+    UDPListener *l;
+
+    bool await_ready() const noexcept { return l->Pending() > 0; }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept { l->AwaitAccept(coroutineWaiter(h)); }
+
+    UDPSession *await_resume() noexcept { return l->Accept(); }
+};
+
+inline ReadAwaiter AsyncRead(UDPSession *sess, char *buf, size_t sz) noexcept {
+    return ReadAwaiter{sess, buf, sz};
+}
+
+inline WriteAwaiter AsyncWrite(UDPSession *sess, const char *buf, size_t sz) noexcept {
+    return WriteAwaiter{sess, buf, sz};
+}
+
+inline AcceptAwaiter AsyncAccept(UDPListener *l) noexcept {
+    return AcceptAwaiter{l};
+}
+
+#endif
+
+#endif //KCP_CORO_H
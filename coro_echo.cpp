@@ -0,0 +1,106 @@
+//
+// coro_echo runs an echo server and a client as coroutines on one EventLoop over
+// loopback, see coro.h. The client sends "-n" messages and checks the echoes, then
+// the server side is torn down while its coroutines are still suspended on it.
+// Build as C++20.
+//
+//   coro_echo -n 1000 -size 512
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "coro.h"
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+
+static std::vector<UDPSession *> g_accepted;
+static bool g_done = false;
+static bool g_ok = true;
+
+static CoTask
+echo(UDPSession *sess) {
+    char buf[4096];
+    for (;;) {
+        ssize_t n = co_await AsyncRead(sess, buf, sizeof(buf));
+        co_await AsyncWrite(sess, buf, size_t(n));
+    }
+}
+
+static CoTask
+serve(EventLoop *loop, UDPListener *l) {
+    for (;;) {
+        UDPSession *sess = co_await AsyncAccept(l);
+        sess->NoDelay(1, 10, 2, 1);
+        loop->Add(sess);
+        g_accepted.push_back(sess);
+        echo(sess);
+    }
+}
+
+static CoTask
+client(UDPSession *sess, size_t count, size_t size) {
+    std::vector<char> msg(size), buf(size);
+    for (size_t i = 0; i < count; i++) {
+        memset(msg.data(), 'a' + int(i % 26), size);
+        co_await AsyncWrite(sess, msg.data(), size);
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = co_await AsyncRead(sess, buf.data() + got, size - got);
+            got += size_t(n);
+        }
+        if (memcmp(msg.data(), buf.data(), size) != 0) {
+            g_ok = false;
+            break;
+        }
+    }
+    g_done = true;
+}
+
+int main(int argc, char **argv) {
+    size_t count = 1000, size = 512;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-n")) count = strtoul(argv[i + 1], nullptr, 10);
+        else if (!strcmp(argv[i], "-size")) size = strtoul(argv[i + 1], nullptr, 10);
+    }
+
+    EventLoop *loop = EventLoop::Create();
+    UDPListener *l = UDPListener::Listen("127.0.0.1", 0);
+    UDPSession *sess = l != nullptr ? UDPSession::Dial("127.0.0.1", l->Port()) : nullptr;
+    if (loop == nullptr || sess == nullptr) {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+    loop->Add(l);
+    sess->NoDelay(1, 10, 2, 1);
+    loop->Add(sess);
+
+    serve(loop, l);
+    client(sess, count, size);
+    uint32_t start = currentMs();
+    while (!g_done && currentMs() - start < 30000) {
+        loop->RunOnce(100);
+    }
+
+    // the echo coroutines wait on their sessions and serve on the listener, destroying
+    // those destroys the coroutines as well
+    for (auto s : g_accepted) {
+        UDPSession::Destroy(s);
+    }
+    UDPListener::Destroy(l);
+    UDPSession::Destroy(sess);
+    EventLoop::Destroy(loop);
+
+    printf("%zu messages of %zu bytes echoed in %u ms: %s\n", count, size, currentMs() - start,
+           g_done && g_ok ? "ok" : "FAILED");
+    return g_done && g_ok ? 0 : 1;
+}
+
+#else
+
+int main() {
+    fprintf(stderr, "coro_echo needs C++20 coroutines\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,520 @@
+#include "crypt.h"
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static inline uint32_t
+load32(const byte *p) noexcept {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static inline void
+store32(byte *p, uint32_t v) noexcept {
+    p[0] = byte(v);
+    p[1] = byte(v >> 8);
+    p[2] = byte(v >> 16);
+    p[3] = byte(v >> 24);
+}
+
+static inline uint64_t
+load64(const byte *p) noexcept {
+    return uint64_t(load32(p)) | uint64_t(load32(p + 4)) << 32;
+}
+
+static inline void
+store64(byte *p, uint64_t v) noexcept {
+    store32(p, uint32_t(v));
+    store32(p + 4, uint32_t(v >> 32));
+}
+
+static int
+randomBytes(byte *p, size_t n) noexcept {
+#ifdef __linux__
+    if (getrandom(p, n, 0) == ssize_t(n)) {
+        return 0;
+    }
+#endif
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t got = read(fd, p, n);
+    close(fd);
+    return got == ssize_t(n) ? 0 : -1;
+}
+
+/*
+ * ChaCha20
+ * 状态为4x4的32位字：4个常量，8个密钥字，1个块计数器，3个nonce字
+ */
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                  \
+    a += b; d ^= a; d = ROTL32(d, 16);            \
+    c += d; b ^= c; b = ROTL32(b, 12);            \
+    a += b; d ^= a; d = ROTL32(d, 8);             \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void
+chachaInit(uint32_t s[16], const uint32_t key[8], uint32_t counter, const byte nonce[cryptNonceSize]) noexcept {
+    s[0] = 0x61707865;
+    s[1] = 0x3320646e;
+    s[2] = 0x79622d32;
+    s[3] = 0x6b206574;
+    memcpy(s + 4, key, 8 * sizeof(uint32_t));
+    s[12] = counter;
+    s[13] = load32(nonce);
+    s[14] = load32(nonce + 4);
+    s[15] = load32(nonce + 8);
+}
+
+static void
+chachaBlock(const uint32_t s[16], byte out[64]) noexcept {
+    uint32_t x[16];
+    memcpy(x, s, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12])
+        QUARTERROUND(x[1], x[5], x[9], x[13])
+        QUARTERROUND(x[2], x[6], x[10], x[14])
+        QUARTERROUND(x[3], x[7], x[11], x[15])
+        QUARTERROUND(x[0], x[5], x[10], x[15])
+        QUARTERROUND(x[1], x[6], x[11], x[12])
+        QUARTERROUND(x[2], x[7], x[8], x[13])
+        QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+    for (int i = 0; i < 16; i++) {
+        store32(out + 4 * i, x[i] + s[i]);
+    }
+}
+
+#ifdef __SSE2__
+
+template<int N>
+static inline __m128i
+rotl4(__m128i v) noexcept {
+    return _mm_or_si128(_mm_slli_epi32(v, N), _mm_srli_epi32(v, 32 - N));
+}
+
+#define QUARTERROUND4(a, b, c, d)                                         \
+    a = _mm_add_epi32(a, b); d = rotl4<16>(_mm_xor_si128(d, a));          \
+    c = _mm_add_epi32(c, d); b = rotl4<12>(_mm_xor_si128(b, c));          \
+    a = _mm_add_epi32(a, b); d = rotl4<8>(_mm_xor_si128(d, a));           \
+    c = _mm_add_epi32(c, d); b = rotl4<7>(_mm_xor_si128(b, c));
+
+// chachaXor4 xors 256 bytes with four consecutive blocks starting at s[12]. Every
+// register holds one state word of all four blocks, which are transposed back to
+// byte order at the end.
+static void
+chachaXor4(const uint32_t s[16], byte *dst, const byte *src) noexcept {
+    const __m128i ctr = _mm_add_epi32(_mm_set1_epi32(int(s[12])), _mm_set_epi32(3, 2, 1, 0));
+    __m128i x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm_set1_epi32(int(s[i]));
+    }
+    x[12] = ctr;
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND4(x[0], x[4], x[8], x[12])
+        QUARTERROUND4(x[1], x[5], x[9], x[13])
+        QUARTERROUND4(x[2], x[6], x[10], x[14])
+        QUARTERROUND4(x[3], x[7], x[11], x[15])
+        QUARTERROUND4(x[0], x[5], x[10], x[15])
+        QUARTERROUND4(x[1], x[6], x[11], x[12])
+        QUARTERROUND4(x[2], x[7], x[8], x[13])
+        QUARTERROUND4(x[3], x[4], x[9], x[14])
+    }
+
+    // the input state is broadcast again rather than kept, it would not fit in registers
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm_add_epi32(x[i], i == 12 ? ctr : _mm_set1_epi32(int(s[i])));
+    }
+    for (int g = 0; g < 4; g++) {
+        __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m128i blk[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                          _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+        for (int k = 0; k < 4; k++) {
+            size_t off = size_t(64 * k + 16 * g);
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + off));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + off), _mm_xor_si128(in, blk[k]));
+        }
+    }
+}
+
+#endif
+
+#ifdef __AVX2__
+
+// rotations by whole bytes are a single shuffle, the others shift
+static inline __m256i
+rotlx(__m256i v, int n) noexcept {
+    return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+}
+
+static inline __m256i
+rotl16x(__m256i v) noexcept {
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    return _mm256_shuffle_epi8(v, rot16);
+}
+
+static inline __m256i
+rotl8x(__m256i v) noexcept {
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                         14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    return _mm256_shuffle_epi8(v, rot8);
+}
+
+#define QUARTERROUND8(a, b, c, d)                                             \
+    a = _mm256_add_epi32(a, b); d = rotl16x(_mm256_xor_si256(d, a));          \
+    c = _mm256_add_epi32(c, d); b = rotlx(_mm256_xor_si256(b, c), 12);        \
+    a = _mm256_add_epi32(a, b); d = rotl8x(_mm256_xor_si256(d, a));           \
+    c = _mm256_add_epi32(c, d); b = rotlx(_mm256_xor_si256(b, c), 7);
+
+// chachaXor8 is chachaXor4 for eight blocks, 512 bytes. The 128 bit lanes hold
+// blocks 0-3 and 4-7, so the transpose of chachaXor4 works on both lanes at once.
+static void
+chachaXor8(const uint32_t s[16], byte *dst, const byte *src) noexcept {
+    const __m256i ctr = _mm256_add_epi32(_mm256_set1_epi32(int(s[12])), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm256_set1_epi32(int(s[i]));
+    }
+    x[12] = ctr;
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND8(x[0], x[4], x[8], x[12])
+        QUARTERROUND8(x[1], x[5], x[9], x[13])
+        QUARTERROUND8(x[2], x[6], x[10], x[14])
+        QUARTERROUND8(x[3], x[7], x[11], x[15])
+        QUARTERROUND8(x[0], x[5], x[10], x[15])
+        QUARTERROUND8(x[1], x[6], x[11], x[12])
+        QUARTERROUND8(x[2], x[7], x[8], x[13])
+        QUARTERROUND8(x[3], x[4], x[9], x[14])
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm256_add_epi32(x[i], i == 12 ? ctr : _mm256_set1_epi32(int(s[i])));
+    }
+    for (int g = 0; g < 4; g++) {
+        __m256i t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+        __m256i blk[4] = {_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+                          _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)};
+        for (int k = 0; k < 4; k++) {
+            size_t lo = size_t(64 * k + 16 * g), hi = lo + 256;
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + lo));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + hi));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + lo), _mm_xor_si128(a, _mm256_castsi256_si128(blk[k])));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + hi), _mm_xor_si128(b, _mm256_extracti128_si256(blk[k], 1)));
+        }
+    }
+}
+
+#endif
+
+// chachaXor xors "len" bytes with the key stream starting at block s[12].
+static void
+chachaXor(uint32_t s[16], byte *dst, const byte *src, size_t len) noexcept {
+#ifdef __AVX2__
+    for (; len >= 512; len -= 512, src += 512, dst += 512) {
+        chachaXor8(s, dst, src);
+        s[12] += 8;
+    }
+#endif
+#ifdef __SSE2__
+    for (; len >= 256; len -= 256, src += 256, dst += 256) {
+        chachaXor4(s, dst, src);
+        s[12] += 4;
+    }
+#endif
+    byte ks[64];
+    while (len > 0) {
+        chachaBlock(s, ks);
+        s[12]++;
+        size_t n = len < 64 ? len : 64;
+        for (size_t i = 0; i < n; i++) {
+            dst[i] = src[i] ^ ks[i];
+        }
+        len -= n;
+        src += n;
+        dst += n;
+    }
+}
+
+/*
+ * Poly1305，44/44/42位分limb，乘法用128位中间结果
+ */
+struct poly1305 {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+    uint64_t hibit;     // 2^128 of a full block, 0 for the padded last block of Poly1305
+};
+
+static const uint64_t mask44 = 0xfffffffffff;
+static const uint64_t mask42 = 0x3ffffffffff;
+
+static void
+polyInit(poly1305 *st, const byte key[32]) noexcept {
+    uint64_t t0 = load64(key);
+    uint64_t t1 = load64(key + 8);
+    st->r[0] = t0 & 0xffc0fffffff;
+    st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    st->r[2] = (t1 >> 24) & 0x00ffffffc0f;
+    st->h[0] = st->h[1] = st->h[2] = 0;
+    st->pad[0] = load64(key + 16);
+    st->pad[1] = load64(key + 24);
+    st->hibit = uint64_t(1) << 40;
+}
+
+// polyBlocks absorbs full 16 byte blocks, AEAD zero-pads every field to a block.
+static void
+polyBlocks(poly1305 *st, const byte *m, size_t len) noexcept {
+    typedef unsigned __int128 u128;
+    const uint64_t hibit = st->hibit;
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    for (; len >= 16; len -= 16, m += 16) {
+        uint64_t t0 = load64(m);
+        uint64_t t1 = load64(m + 8);
+        h0 += t0 & mask44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+        h2 += ((t1 >> 24) & mask42) | hibit;
+
+        u128 d0 = u128(h0) * r0 + u128(h1) * s2 + u128(h2) * s1;
+        u128 d1 = u128(h0) * r1 + u128(h1) * r0 + u128(h2) * s2;
+        u128 d2 = u128(h0) * r2 + u128(h1) * r1 + u128(h2) * r0;
+
+        uint64_t c = uint64_t(d0 >> 44);
+        h0 = uint64_t(d0) & mask44;
+        d1 += c;
+        c = uint64_t(d1 >> 44);
+        h1 = uint64_t(d1) & mask44;
+        d2 += c;
+        c = uint64_t(d2 >> 42);
+        h2 = uint64_t(d2) & mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+static void
+polyPadded(poly1305 *st, const byte *m, size_t len) noexcept {
+    size_t full = len & ~size_t(15);
+    polyBlocks(st, m, full);
+    if (len > full) {
+        byte block[16] = {0};
+        memcpy(block, m + full, len - full);
+        polyBlocks(st, block, 16);
+    }
+}
+
+static void
+polyFinish(poly1305 *st, byte mac[16]) noexcept {
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    // fully carry h
+    uint64_t c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+
+    // g = h - p, select h or g in constant time
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= mask44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= mask44;
+    uint64_t g2 = h2 + c - (uint64_t(1) << 42);
+
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    // h + pad
+    uint64_t t0 = st->pad[0];
+    uint64_t t1 = st->pad[1];
+    h0 += t0 & mask44;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += ((t1 >> 24) & mask42) + c;
+    h2 &= mask42;
+
+    store64(mac, h0 | (h1 << 44));
+    store64(mac + 8, (h1 >> 20) | (h2 << 24));
+}
+
+// tag computes the Poly1305 tag of a ciphertext without associated data
+static void
+tag(const uint32_t s0[16], const byte *ct, size_t len, byte mac[16]) noexcept {
+    byte polykey[64];
+    chachaBlock(s0, polykey);   // block 0 keys Poly1305, the payload starts at block 1
+
+    poly1305 st;
+    polyInit(&st, polykey);
+    polyPadded(&st, ct, len);
+    byte lens[16];
+    store64(lens, 0);
+    store64(lens + 8, uint64_t(len));
+    polyBlocks(&st, lens, 16);
+    polyFinish(&st, mac);
+}
+
+void
+ChaCha20(byte *dst, const byte *src, size_t len, const byte *key, uint32_t counter,
+         const byte *nonce) noexcept {
+    uint32_t k[8];
+    for (int i = 0; i < 8; i++) {
+        k[i] = load32(key + 4 * i);
+    }
+    uint32_t s[16];
+    chachaInit(s, k, counter, nonce);
+    chachaXor(s, dst, src, len);
+}
+
+void
+Poly1305(byte mac[cryptTagSize], const byte *m, size_t len, const byte *key) noexcept {
+    poly1305 st;
+    polyInit(&st, key);
+    size_t full = len & ~size_t(15);
+    polyBlocks(&st, m, full);
+    if (len > full) {
+        // the last block is padded with 1 and zeros instead of the 2^128 bit
+        byte block[16] = {0};
+        memcpy(block, m + full, len - full);
+        block[len - full] = 1;
+        st.hibit = 0;
+        polyBlocks(&st, block, 16);
+    }
+    polyFinish(&st, mac);
+}
+
+AEAD *
+AEAD::New(const byte *key, size_t keylen) {
+    if (key == nullptr || keylen != cryptKeySize) {
+        return nullptr;
+    }
+
+    AEAD *aead = new(AEAD);
+    for (int i = 0; i < 8; i++) {
+        aead->m_key[i] = load32(key + 4 * i);
+    }
+    if (randomBytes(aead->m_nonce, sizeof(aead->m_nonce)) < 0) {
+        delete aead;
+        return nullptr;
+    }
+    return aead;
+}
+
+void
+AEAD::Destroy(AEAD *aead) {
+    if (nullptr == aead) return;
+    memset(aead->m_key, 0, sizeof(aead->m_key));
+    delete aead;
+}
+
+size_t
+AEAD::Seal(byte *pkt, const byte *src, size_t len) noexcept {
+    // next nonce, the low 64 bits count packets
+    uint64_t ctr = load64(m_nonce) + 1;
+    store64(m_nonce, ctr);
+    memcpy(pkt, m_nonce, cryptNonceSize);
+
+    uint32_t s[16];
+    chachaInit(s, m_key, 1, m_nonce);
+    byte *ct = pkt + cryptNonceSize;
+    chachaXor(s, ct, src, len);
+
+    chachaInit(s, m_key, 0, m_nonce);
+    tag(s, ct, len, ct + len);
+    return len + cryptOverhead;
+}
+
+ssize_t
+AEAD::Open(byte *pkt, size_t len) noexcept {
+    if (len < cryptOverhead) {
+        return -1;
+    }
+
+    size_t n = len - cryptOverhead;
+    byte *ct = pkt + cryptNonceSize;
+    uint32_t s[16];
+    chachaInit(s, m_key, 0, pkt);
+
+    byte mac[16];
+    tag(s, ct, n, mac);
+    byte diff = 0;
+    for (size_t i = 0; i < cryptTagSize; i++) {
+        diff |= byte(mac[i] ^ ct[n + i]);
+    }
+    if (diff != 0) {
+        return -1;
+    }
+
+    s[12] = 1;
+    chachaXor(s, ct, ct, n);
+    return ssize_t(n);
+}
+
+int
+AEAD::OpenBatch(Datagram *dgrams, int n) noexcept {
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        ssize_t sz = Open(dgrams[i].data, dgrams[i].len);
+        if (sz < 0) {
+            continue;
+        }
+        dgrams[k] = dgrams[i];
+        dgrams[k].data += cryptNonceSize;
+        dgrams[k].len = size_t(sz);
+        k++;
+    }
+    return k;
+}
@@ -0,0 +1,63 @@
+#ifndef KCP_CRYPT_H
+#define KCP_CRYPT_H
+
+#include "batch.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+const size_t cryptKeySize = 32;
+const size_t cryptNonceSize = 12;   // headroom in front of every sealed packet
+const size_t cryptTagSize = 16;     // tailroom behind every sealed packet
+const size_t cryptOverhead = cryptNonceSize + cryptTagSize;
+
+// AEAD seals datagrams with ChaCha20-Poly1305 (RFC 8439):
+//
+//   [nonce 12B] [ciphertext] [tag 16B]
+//
+// Nonces are a random start incremented per packet, so one key may be shared by
+// many sessions. ChaCha20 runs four blocks at a time in SSE2 registers where
+// available, Poly1305 uses 44 bit limbs with 128 bit products, so no external crypto
+// library is needed.
+// ChaCha20 xors "len" bytes from "src" to "dst" with the key stream of "key" and
+// "nonce" starting at block "counter". "dst" may be "src".
+void ChaCha20(byte *dst, const byte *src, size_t len, const byte *key, uint32_t counter,
+              const byte *nonce) noexcept;
+
+// Poly1305 computes the one-time authenticator of "len" bytes under a 32 byte key.
+void Poly1305(byte mac[cryptTagSize], const byte *m, size_t len, const byte *key) noexcept;
+
+class AEAD {
+public:
+    AEAD(const AEAD &) = delete;
+
+    AEAD &operator=(const AEAD &) = delete;
+
+    // New returns an AEAD with a 32 byte key, or nullptr if the key size is wrong
+    // or no randomness is available for the nonces.
+    static AEAD *New(const byte *key, size_t keylen);
+
+    static void Destroy(AEAD *aead);
+
+    // Seal encrypts "len" bytes from "src" to "pkt + cryptNonceSize", writes the nonce
+    // in front and the tag behind, and returns the packet size, len + cryptOverhead.
+    // "src" may be "pkt + cryptNonceSize" to seal in place.
+    size_t Seal(byte *pkt, const byte *src, size_t len) noexcept;
+
+    // Open authenticates and decrypts a packet in place, the plaintext starts at
+    // pkt + cryptNonceSize. Returns the plaintext size, or -1 if the packet is forged.
+    ssize_t Open(byte *pkt, size_t len) noexcept;
+
+    // OpenBatch opens every datagram of a receive batch, pointing it at its plaintext,
+    // and drops the forged ones. Returns the number of datagrams left.
+    int OpenBatch(Datagram *dgrams, int n) noexcept;
+
+private:
+    AEAD() = default;
+
+    ~AEAD() = default;
+
+    uint32_t m_key[8]{};
+    byte m_nonce[cryptNonceSize]{};
+};
+
+#endif //KCP_CRYPT_H
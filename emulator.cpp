@@ -0,0 +1,187 @@
+#include "emulator.h"
+
+static inline uint64_t
+nowUs() {
+    return clockNow() / 1000;
+}
+
+// EmuTransport is one side of an EmuLink.
+class EmuTransport : public Transport {
+public:
+    EmuTransport(EmuLink *link, int side) : m_link(link), m_side(side) {}
+
+    int Recv(Datagram **dgrams, bool *more) noexcept override {
+        m_link->deliver(1 - m_side, nowUs(), m_rx, m_batch);
+
+        // stamped with the arrival, as the kernel would
+        m_segs.clear();
+        for (auto &p : m_rx) {
+            uint64_t stamp = m_stamps ? p.first * 1000 : 0;
+            m_segs.push_back(Datagram{p.second.data(), p.second.size(), nullptr, 0, stamp});
+        }
+        *dgrams = m_segs.data();
+        *more = m_segs.size() == m_batch;
+        return int(m_segs.size());
+    }
+
+    bool Send(const void *buf, size_t len, const struct sockaddr *, socklen_t) noexcept override {
+        m_link->send(m_side, buf, len, nowUs());
+        m_sent++;
+        return true;
+    }
+
+    int Flush() noexcept override {
+        int n = m_sent;
+        m_sent = 0;
+        return n;
+    }
+
+    inline int Fd() const noexcept override { return -1; }
+
+    void SetRecvBatch(size_t n) noexcept override { m_batch = n > 0 ? n : 1; }
+
+    int SetTimestamps(bool enable) noexcept override {
+        m_stamps = enable;
+        return 0;
+    }
+
+    size_t MaxDatagram(size_t n) noexcept override { return n < gsoMaxBytes ? n : gsoMaxBytes; }
+
+private:
+    EmuLink *m_link;
+    int m_side;
+    int m_sent{0};
+    bool m_stamps{false};
+    size_t m_batch{defaultRecvBatch};
+    std::vector<std::pair<uint64_t, std::vector<byte>>> m_rx;  // valid until the next Recv
+    std::vector<Datagram> m_segs;
+};
+
+EmuLink *
+EmuLink::New(const LinkProfile &ab, const LinkProfile &ba, uint64_t seed) {
+    EmuLink *link = new(EmuLink);
+    link->m_dirs[0].profile = ab;
+    link->m_dirs[1].profile = ba;
+    link->m_rng = seed;
+    return link;
+}
+
+void
+EmuLink::Destroy(EmuLink *link) {
+    delete link;
+}
+
+Transport *
+EmuLink::Endpoint(int side) {
+    if (side != 0 && side != 1) {
+        return nullptr;
+    }
+    return new EmuTransport(this, side);
+}
+
+void
+EmuLink::SetProfile(int side, const LinkProfile &p) noexcept {
+    m_dirs[side].profile = p;
+}
+
+EmuStats
+EmuLink::GetStats(int side) const noexcept {
+    return m_dirs[side].stats;
+}
+
+uint64_t
+EmuLink::NextArrival(int side) const noexcept {
+    auto &q = m_dirs[side].queue;
+    return q.empty() ? 0 : q.begin()->first.first;
+}
+
+double
+EmuLink::random() noexcept {
+    uint64_t z = (m_rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return double(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * 一个数据报在链路上的经历：
+ * 1. Gilbert-Elliott两状态模型决定是否丢包
+ * 2. 在瓶颈处排队，队列满则尾部丢弃，按速率串行发出
+ * 3. 传播时延加抖动，抖动不改变顺序，只有被选中乱序的数据报会额外延迟并被后来者超过
+ * 4. 按概率复制一份
+ */
+void
+EmuLink::send(int side, const void *buf, size_t len, uint64_t now) noexcept {
+    direction &d = m_dirs[side];
+    const LinkProfile &p = d.profile;
+    d.stats.sent++;
+
+    if (p.goodToBad > 0) {
+        if (d.bad) {
+            d.bad = random() >= p.badToGood;
+        } else {
+            d.bad = random() < p.goodToBad;
+        }
+    }
+    double loss = d.bad ? p.burstLoss : p.loss;
+    if (loss > 0 && random() < loss) {
+        d.stats.lost++;
+        return;
+    }
+
+    uint64_t start = now;
+    if (p.rateBps > 0) {
+        if (d.linkFree > now) {
+            uint64_t backlog = (d.linkFree - now) * p.rateBps / 8000000;
+            if (p.queueBytes > 0 && backlog + len > p.queueBytes) {
+                d.stats.queueDrops++;
+                return;
+            }
+            start = d.linkFree;
+        }
+        d.linkFree = start + (uint64_t(len) * 8000000 + p.rateBps - 1) / p.rateBps;
+        start = d.linkFree;
+    }
+
+    int copies = 1;
+    if (p.duplicate > 0 && random() < p.duplicate) {
+        d.stats.duplicated++;
+        copies = 2;
+    }
+    for (int i = 0; i < copies; i++) {
+        uint64_t due = start + p.delayUs;
+        if (p.jitterUs > 0) {
+            due += uint64_t(random() * (double(p.jitterUs) + 1));
+        }
+        if (p.reorder > 0 && random() < p.reorder) {
+            d.stats.reordered++;
+            due += p.reorderUs;
+        } else {
+            if (due < d.lastDue) {
+                due = d.lastDue;
+            }
+            d.lastDue = due;
+        }
+
+        const byte *b = static_cast<const byte *>(buf);
+        d.queue.emplace(std::make_pair(due, m_seq++), std::vector<byte>(b, b + len));
+    }
+}
+
+size_t
+EmuLink::deliver(int side, uint64_t now, std::vector<std::pair<uint64_t, std::vector<byte>>> &out,
+                 size_t max) noexcept {
+    direction &d = m_dirs[side];
+    out.clear();
+    while (!d.queue.empty() && out.size() < max) {
+        auto it = d.queue.begin();
+        if (it->first.first > now) {
+            break;
+        }
+        out.emplace_back(it->first.first, std::move(it->second));
+        d.queue.erase(it);
+    }
+    d.stats.delivered += out.size();
+    return out.size();
+}
@@ -0,0 +1,108 @@
+#ifndef KCP_EMULATOR_H
+#define KCP_EMULATOR_H
+
+#include "transport.h"
+#include <map>
+#include <utility>
+#include <vector>
+
+// LinkProfile describes one direction of an emulated link. Datagrams first wait for
+// the bottleneck (rateBps, queueBytes), then travel for delayUs plus jitter.
+struct LinkProfile {
+    uint32_t delayUs;       // one-way propagation delay
+    uint32_t jitterUs;      // uniform extra delay in [0, jitterUs], order is kept
+    double loss;            // loss probability per datagram, in the good state
+    double burstLoss;       // loss probability in the bad state
+    double goodToBad;       // Gilbert-Elliott transition probabilities per datagram,
+    double badToGood;       // burst loss is off while goodToBad is 0
+    double reorder;         // probability a datagram is held back by reorderUs and overtaken
+    uint32_t reorderUs;
+    double duplicate;       // probability a datagram is delivered twice
+    uint64_t rateBps;       // bottleneck rate in bits per second, 0 is unlimited
+    size_t queueBytes;      // bottleneck queue, datagrams beyond it are tail dropped, 0 is unlimited
+};
+
+struct EmuStats {
+    uint64_t sent;          // datagrams handed to the link
+    uint64_t delivered;     // datagrams received, duplicates included
+    uint64_t lost;          // random and burst loss
+    uint64_t queueDrops;    // tail drops at the bottleneck
+    uint64_t duplicated;
+    uint64_t reordered;
+};
+
+// EmuLink is an in-memory network between two endpoints, side 0 and side 1, for
+// reproducible comparisons without a network or a second process: the same profile
+// and seed give the same losses, delays and reorderings for the same traffic.
+// Time is the installed Clock (see SetClock), so the sessions on the endpoints are
+// driven by Update as usual, in real or in virtual time.
+//
+//   EmuLink *link = EmuLink::New(profile, profile, 1);
+//   auto a = UDPSession::DialTransport(link->Endpoint(0), conv, 0, 0);
+//   auto b = UDPSession::DialTransport(link->Endpoint(1), conv, 0, 0);
+//
+// The link is not thread-safe, and must outlive both endpoints.
+class EmuLink {
+public:
+    EmuLink(const EmuLink &) = delete;
+
+    EmuLink &operator=(const EmuLink &) = delete;
+
+    // New creates a link, "ab" is the direction from side 0 to side 1.
+    static EmuLink *New(const LinkProfile &ab, const LinkProfile &ba, uint64_t seed);
+
+    // Destroy drops the datagrams still in flight.
+    static void Destroy(EmuLink *link);
+
+    // Endpoint returns a new transport for "side", owned by the caller or the session
+    // it is passed to. It has no descriptor, so it can't be added to an EventLoop.
+    Transport *Endpoint(int side);
+
+    // SetProfile changes the direction leaving "side", datagrams in flight keep their timing.
+    void SetProfile(int side, const LinkProfile &p) noexcept;
+
+    // GetStats returns the counters of the direction leaving "side".
+    EmuStats GetStats(int side) const noexcept;
+
+    // NextArrival returns the time (clock microseconds) the next datagram sent by "side"
+    // arrives, 0 if none is in flight.
+    uint64_t NextArrival(int side) const noexcept;
+
+    // InFlight returns the datagrams sent by "side" which are not delivered yet.
+    inline size_t InFlight(int side) const noexcept { return m_dirs[side].queue.size(); }
+
+private:
+    EmuLink() = default;
+
+    ~EmuLink() = default;
+
+    // datagrams by (due time, sequence), the sequence breaks ties in sending order
+    typedef std::map<std::pair<uint64_t, uint64_t>, std::vector<byte>> flight;
+
+    struct direction {
+        LinkProfile profile;
+        bool bad;               // Gilbert-Elliott state
+        uint64_t linkFree;      // time the bottleneck has sent everything queued
+        uint64_t lastDue;       // latest in-order delivery, jitter doesn't reorder
+        flight queue;
+        EmuStats stats;
+    };
+
+    // send puts one datagram from "side" on the wire at "now" (clock microseconds).
+    void send(int side, const void *buf, size_t len, uint64_t now) noexcept;
+
+    // deliver moves up to "max" datagrams due at "now" for "side" into "out".
+    size_t deliver(int side, uint64_t now, std::vector<std::pair<uint64_t, std::vector<byte>>> &out,
+                   size_t max) noexcept;
+
+    // random returns a uniform double in [0, 1) from a splitmix64 stream.
+    double random() noexcept;
+
+    direction m_dirs[2]{};
+    uint64_t m_rng{0};
+    uint64_t m_seq{0};
+
+    friend class EmuTransport;
+};
+
+#endif //KCP_EMULATOR_H
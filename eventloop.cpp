@@ -0,0 +1,388 @@
+#include "eventloop.h"
+#include "threaded.h"
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpuRelax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpuRelax() __asm__ __volatile__("yield")
+#else
+#define cpuRelax() do {} while (0)
+#endif
+
+static inline uint64_t
+monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+}
+
+EventLoop *
+EventLoop::Create() {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        return nullptr;
+    }
+
+    EventLoop *loop = new(EventLoop);
+    loop->m_epfd = epfd;
+    loop->m_current = currentMs();
+    return loop;
+}
+
+void
+EventLoop::Destroy(EventLoop *loop) {
+    if (nullptr == loop) return;
+
+    for (auto &kv : loop->m_due) {
+        kv.first->m_loop = nullptr;
+    }
+    for (auto l : loop->m_listeners) {
+        l->m_loop = nullptr;
+    }
+    for (auto &kv : loop->m_pollables) {
+        if (kv.second->ts != nullptr) {
+            kv.second->ts->m_loop = nullptr;
+            kv.second->ts->m_sess->m_front = nullptr;
+        }
+        delete kv.second;
+    }
+
+    if (0 <= loop->m_epfd) { close(loop->m_epfd); }
+    delete loop;
+}
+
+int
+EventLoop::Add(UDPSession *sess) noexcept {
+    if (sess->m_loop != nullptr) {
+        return sess->m_loop == this ? 0 : -1;
+    }
+
+    // accepted sessions have no socket of their own, their listener is polled instead
+    if (sess->m_listener == nullptr) {
+        auto p = new pollable{sess, nullptr, nullptr};
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = p;
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, sess->m_io->Fd(), &ev) < 0) {
+            delete p;
+            return -1;
+        }
+        m_pollables[sess] = p;
+    }
+
+    sess->m_loop = this;
+    schedule(sess, m_current);
+    return 0;
+}
+
+int
+EventLoop::Add(UDPListener *l) noexcept {
+    if (l->m_loop != nullptr) {
+        return l->m_loop == this ? 0 : -1;
+    }
+
+    auto p = new pollable{nullptr, l, nullptr};
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, l->m_io->Fd(), &ev) < 0) {
+        delete p;
+        return -1;
+    }
+    m_pollables[l] = p;
+    m_listeners.push_back(l);
+    l->m_loop = this;
+
+    // sessions created before the listener was registered
+    for (auto &kv : l->m_sessions) {
+        Add(kv.second);
+    }
+    return 0;
+}
+
+int
+EventLoop::Add(ThreadedSession *ts) noexcept {
+    if (ts->m_loop != nullptr) {
+        return ts->m_loop == this ? 0 : -1;
+    }
+    bool added = ts->m_sess->m_loop == nullptr;
+    if (Add(ts->m_sess) < 0) {
+        return -1;
+    }
+
+    auto p = new pollable{nullptr, nullptr, ts};
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, ts->Fd(), &ev) < 0) {
+        delete p;
+        if (added) {
+            Remove(ts->m_sess);  // leave the session as it was
+        }
+        return -1;
+    }
+    m_pollables[ts] = p;
+    ts->m_loop = this;
+    ts->m_sess->m_front = ts;
+
+    // writes queued before the front-end was registered
+    ts->drain();
+    return 0;
+}
+
+void
+EventLoop::Remove(ThreadedSession *ts) noexcept {
+    if (ts->m_loop != this) {
+        return;
+    }
+
+    auto it = m_pollables.find(ts);
+    if (it != m_pollables.end()) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, ts->Fd(), nullptr);
+        delete it->second;
+        m_pollables.erase(it);
+    }
+    ts->m_sess->m_front = nullptr;
+    ts->m_loop = nullptr;
+}
+
+void
+EventLoop::Remove(UDPSession *sess) noexcept {
+    if (sess->m_loop != this) {
+        return;
+    }
+
+    auto it = m_pollables.find(sess);
+    if (it != m_pollables.end()) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, sess->m_io->Fd(), nullptr);
+        delete it->second;
+        m_pollables.erase(it);
+    }
+
+    // the heap entry goes stale and is skipped once it surfaces
+    m_due.erase(sess);
+    m_touched.erase(std::remove(m_touched.begin(), m_touched.end(), sess), m_touched.end());
+    sess->m_touched = false;
+    sess->m_loop = nullptr;
+}
+
+void
+EventLoop::Remove(UDPListener *l) noexcept {
+    if (l->m_loop != this) {
+        return;
+    }
+
+    for (auto &kv : l->m_sessions) {
+        Remove(kv.second);
+    }
+
+    auto it = m_pollables.find(l);
+    if (it != m_pollables.end()) {
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, l->m_io->Fd(), nullptr);
+        delete it->second;
+        m_pollables.erase(it);
+    }
+    m_listeners.erase(std::remove(m_listeners.begin(), m_listeners.end(), l), m_listeners.end());
+    l->m_loop = nullptr;
+}
+
+int
+EventLoop::rebind(const void *owner, int oldfd, int newfd) noexcept {
+    auto it = m_pollables.find(owner);
+    if (it == m_pollables.end()) {
+        return 0;
+    }
+
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, oldfd, nullptr);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = it->second;
+    return epoll_ctl(m_epfd, EPOLL_CTL_ADD, newfd, &ev);
+}
+
+void
+EventLoop::Notify(UDPSession *sess) noexcept {
+    if (sess->m_loop == this) {
+        schedule(sess, m_current);
+    }
+}
+
+void
+EventLoop::schedule(UDPSession *sess, uint32_t due) noexcept {
+    auto it = m_due.find(sess);
+    if (it != m_due.end() && it->second.armed && int32_t(due - it->second.due) >= 0) {
+        return; // an earlier deadline is already armed
+    }
+    m_due[sess] = deadline{due, true};
+    m_timers.push(timer{due, sess});
+}
+
+void
+EventLoop::update(UDPSession *sess, uint32_t current) noexcept {
+    // writes held back on a full send window go out as acks make room
+    if (sess->m_front != nullptr) {
+        sess->m_front->drain();
+    }
+    sess->Update(current);
+    if (sess->m_front != nullptr) {
+        sess->m_front->deliver();
+    }
+
+    // resumed after the round, a waiter may destroy sessions or add new ones, see RunOnce
+    if (sess->m_readWaiter.frame != nullptr && sess->PeekSize() > 0) {
+        m_wakeups.push_back(wakeup{sess->m_readWaiter, sess});
+        sess->m_readWaiter = Waiter{};
+    }
+    if (sess->m_writeWaiter.frame != nullptr && sess->Writable()) {
+        m_wakeups.push_back(wakeup{sess->m_writeWaiter, sess});
+        sess->m_writeWaiter = Waiter{};
+    }
+
+    // no timer for an idle session, its stale heap entry is skipped once it surfaces
+    if (sess->Idle()) {
+        m_due[sess] = deadline{0, false};
+        return;
+    }
+
+    // Update just flushed, so a deadline of "now" would only spin, wait a tick at least
+    uint32_t due = sess->Check(current);
+    if (int32_t(due - current) <= 0) {
+        due = current + 1;
+    }
+    m_due[sess] = deadline{due, true};
+    m_timers.push(timer{due, sess});
+}
+
+int
+EventLoop::wait(int timeout) noexcept {
+    if (m_spinUs == 0 || timeout == 0) {
+        return epoll_wait(m_epfd, m_events, maxEvents, timeout);
+    }
+
+    // spin no longer than the nearest timer allows
+    uint64_t budget = m_spinUs;
+    if (timeout > 0 && uint64_t(timeout) * 1000 < budget) {
+        budget = uint64_t(timeout) * 1000;
+    }
+    uint64_t start = monotonicUs();
+    uint64_t spent = 0;
+    while (spent < budget) {
+        int n = epoll_wait(m_epfd, m_events, maxEvents, 0);
+        if (n != 0) {
+            return n;
+        }
+        cpuRelax();
+        spent = monotonicUs() - start;
+    }
+
+    if (timeout > 0) {
+        timeout -= int(spent / 1000);
+        if (timeout < 0) {
+            timeout = 0;
+        }
+    }
+    return epoll_wait(m_epfd, m_events, maxEvents, timeout);
+}
+
+/*
+ * 一轮事件循环：
+ * 1. 以最近的kcp定时器作为epoll_wait的超时
+ * 2. 有数据可读的会话立即Update，监听socket上的数据分发给各个会话后，只更新收到数据的会话
+ * 3. 处理所有到期的定时器，Update之后按ikcp_check重新调度
+ */
+int
+EventLoop::RunOnce(int timeout) noexcept {
+    uint32_t now = currentMs();
+    if (!m_timers.empty()) {
+        int32_t wait = int32_t(m_timers.top().due - now);
+        if (wait < 0) {
+            wait = 0;
+        }
+        if (timeout < 0 || wait < timeout) {
+            timeout = wait;
+        }
+    }
+
+    int n = wait(timeout);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    now = currentMs();
+    m_current = now;
+    int updates = 0;
+
+    for (int i = 0; i < n; i++) {
+        auto p = static_cast<pollable *>(m_events[i].data.ptr);
+        if (p->sess != nullptr) {
+            update(p->sess, now);
+            updates++;
+        } else if (p->l != nullptr) {
+            p->l->receive(&m_touched, now);
+        } else {
+            // writes are flushed by the session update they schedule, a reader
+            // which made room gets the messages held back so far
+            p->ts->drain();
+            p->ts->deliver();
+        }
+    }
+
+    // sessions fed by a listener, including the ones it just created
+    for (size_t i = 0; i < m_touched.size(); i++) {
+        auto sess = m_touched[i];
+        sess->m_touched = false;
+        if (sess->m_loop == nullptr) {
+            sess->m_loop = this;
+        }
+        update(sess, now);
+        updates++;
+    }
+    m_touched.clear();
+
+    while (!m_timers.empty() && int32_t(now - m_timers.top().due) >= 0) {
+        timer t = m_timers.top();
+        m_timers.pop();
+
+        auto it = m_due.find(t.sess);
+        if (it == m_due.end() || !it->second.armed || it->second.due != t.due) {
+            continue;   // removed or rescheduled since
+        }
+        update(t.sess, now);
+        updates++;
+    }
+
+    for (auto l : m_listeners) {
+        l->flush(now);
+        if (l->m_acceptWaiter.frame != nullptr && !l->m_accepts.empty()) {
+            m_wakeups.push_back(wakeup{l->m_acceptWaiter, l});
+            l->m_acceptWaiter = Waiter{};
+        }
+    }
+
+    // a waiter may destroy sessions, whose waiters further down are dropped then
+    m_resuming.swap(m_wakeups);
+    for (size_t i = 0; i < m_resuming.size(); i++) {
+        Waiter w = m_resuming[i].w;
+        if (w.frame != nullptr) {
+            w.resume(w.frame);
+        }
+    }
+    m_resuming.clear();
+    return updates;
+}
+
+void
+EventLoop::dropWaiters(const void *owner) noexcept {
+    for (auto *queue : {&m_wakeups, &m_resuming}) {
+        for (auto &e : *queue) {
+            if (e.owner == owner && e.w.frame != nullptr) {
+                dropWaiter(e.w);
+            }
+        }
+    }
+}
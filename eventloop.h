@@ -0,0 +1,131 @@
+#ifndef KCP_EVENTLOOP_H
+#define KCP_EVENTLOOP_H
+
+#include "sess.h"
+#include "listener.h"
+#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <sys/epoll.h>
+
+class ThreadedSession;
+
+const int maxEvents = 256;  // epoll events per wait
+
+// EventLoop drives many sessions and listeners from one thread. Sockets are
+// watched with epoll and every session is updated only when it has input or
+// when ikcp_check says its kcp timer is due. Idle sessions (see UDPSession::Idle)
+// have no timer at all, they cost nothing until input, Write or Read.
+class EventLoop {
+public:
+    EventLoop(const EventLoop &) = delete;
+
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // Create returns a new event loop, or nullptr if epoll is unavailable.
+    static EventLoop *Create();
+
+    // Destroy release all resource related, registered sessions and listeners are
+    // removed from the loop but not destroyed.
+    static void Destroy(EventLoop *loop);
+
+    // Add registers a session, the loop calls its Update from now on.
+    // Sessions accepted by a registered listener are added automatically.
+    int Add(UDPSession *sess) noexcept;
+
+    // Add registers a listener and all sessions it accepts.
+    int Add(UDPListener *l) noexcept;
+
+    // Add registers a threaded front-end and its session, queued writes are handed to
+    // kcp as soon as they arrive and received messages after every session update.
+    int Add(ThreadedSession *ts) noexcept;
+
+    // Remove unregisters a session, UDPSession::Destroy does it automatically.
+    void Remove(UDPSession *sess) noexcept;
+
+    // Remove unregisters a listener, UDPListener::Destroy does it automatically.
+    void Remove(UDPListener *l) noexcept;
+
+    // Remove unregisters a threaded front-end, ThreadedSession::Destroy does it automatically.
+    void Remove(ThreadedSession *ts) noexcept;
+
+    // Notify asks for the session to be updated on the next round, e.g. after Write.
+    void Notify(UDPSession *sess) noexcept;
+
+    // SetBusyPoll makes RunOnce spin on a zero-timeout epoll_wait for up to "spinUs"
+    // microseconds before it blocks, so that a datagram arriving within the budget
+    // is handled without a wakeup. Pass 0, the default, to always block. The spin
+    // only pays off with a core to itself, it starves whatever shares the core.
+    inline void SetBusyPoll(uint32_t spinUs) noexcept { m_spinUs = spinUs; }
+
+    // RunOnce waits up to "timeout" ms (-1 waits until something is due) for socket
+    // readiness or kcp timers, and updates the sessions concerned. Waiters whose
+    // session or listener became ready are resumed last, on this thread.
+    // Returns the number of session updates, or -1 on error.
+    int RunOnce(int timeout) noexcept;
+
+    inline size_t Sessions() const { return m_due.size(); }
+
+private:
+    EventLoop() = default;
+
+    ~EventLoop() = default;
+
+    struct timer {
+        uint32_t due;
+        UDPSession *sess;
+
+        // min-heap ordering on a wrapping millisecond clock
+        bool operator<(const timer &other) const { return int32_t(due - other.due) > 0; }
+    };
+
+    // pollable is what epoll reports back, exactly one of sess, l and ts is set.
+    struct pollable {
+        UDPSession *sess;
+        UDPListener *l;
+        ThreadedSession *ts;
+    };
+
+    void schedule(UDPSession *sess, uint32_t due) noexcept;
+
+    // rebind moves the epoll registration of "owner" from "oldfd" to "newfd",
+    // used when a session or listener switches transport.
+    int rebind(const void *owner, int oldfd, int newfd) noexcept;
+
+    void update(UDPSession *sess, uint32_t current) noexcept;
+
+    // wait is epoll_wait, preceded by the busy poll spin if enabled
+    int wait(int timeout) noexcept;
+
+    // dropWaiters frees the waiters of "owner" queued for resumption, which is being
+    // destroyed, possibly by a waiter resumed earlier in the same round.
+    void dropWaiters(const void *owner) noexcept;
+
+    int m_epfd{-1};
+    uint32_t m_current{0};
+    uint32_t m_spinUs{0};
+    std::priority_queue<timer> m_timers;            // may hold stale entries
+    struct deadline {
+        uint32_t due;
+        bool armed;     // false while the session is idle
+    };
+
+    std::unordered_map<UDPSession *, deadline> m_due;   // the live deadline of every session
+    std::unordered_map<const void *, pollable *> m_pollables;
+    std::vector<UDPListener *> m_listeners;
+    std::vector<UDPSession *> m_touched;
+    struct wakeup {
+        Waiter w;
+        const void *owner;  // the session or listener waited on
+    };
+
+    std::vector<wakeup> m_wakeups;      // waiters to resume at the end of the round
+    std::vector<wakeup> m_resuming;     // the ones being resumed
+    struct epoll_event m_events[maxEvents];
+
+    friend class UDPSession;
+
+    friend class UDPListener;
+};
+
+#endif //KCP_EVENTLOOP_H
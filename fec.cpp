@@ -3,10 +3,8 @@
 //
 
 #include <err.h>
-#include <sys/time.h>
 #include <iostream>
 #include "fec.h"
-#include "sess.h"
 #include "encoding.h"
 
 FEC
@@ -38,9 +36,6 @@ FEC::Decode(byte *data, size_t sz) {
     data = decode32u(data, &pkt.seqid);     // 填充pkt.seqid
     data = decode16u(data, &pkt.flag);      // 填充pkt.flag
     pkt.data = std::make_shared<std::vector<byte>>(data, data + sz - fecHeaderSize);  // pkt.data
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    pkt.ts = uint32_t(time.tv_sec * 1000 + time.tv_usec / 1000);  // 填充pkt.ts
     return pkt;
 }
 
@@ -71,7 +66,7 @@ FEC::MarkFEC(byte *data) {
  */
 
 std::vector<row_type>
-FEC::Input(fecPacket &pkt) {
+FEC::Input(fecPacket &pkt, uint32_t current) {
     // row_type 或者 std::shared_ptr<std::vector<bytes>> 就代表一个symbol
     // std::vector<row_type> 这样就代表一组symbol，或者说是block
     std::vector<row_type> recovered;
@@ -81,15 +76,15 @@ FEC::Input(fecPacket &pkt) {
      * 启用FEC会带来的一个问题就是说，接收到的fecPacket由于种种原因，没利用起来，堆积在那里
      * 这里就是定期处理这个问题
      */
-    uint32_t now = currentMs();
-    if (now - lastCheck >= fecExpire) {
+    pkt.ts = current;   // 填充pkt.ts, 由调用者每轮读一次时钟
+    if (current - lastCheck >= fecExpire) {
         for (auto it = rx.begin(); it != rx.end();) {     // std::vector<fecPacket>
-            if (now - it->ts > fecExpire)
+            if (current - it->ts > fecExpire)
                 it = rx.erase(it);
             else
                 it++;
         }
-        lastCheck = now;
+        lastCheck = current;
     }
 
 
@@ -116,9 +111,9 @@ FEC::Input(fecPacket &pkt) {
     // 注意，实际情况中，由于网络的影响，searchBegin、searchEnd中
     // 会掺杂shardBegin、shardEnd范围之外的元素
     auto searchBegin = insertIdx - int(pkt.seqid % totalShards);
-    searchBegin = searchBegin < 0 : 0, searchBegin;
+    searchBegin = searchBegin < 0 ? 0 : searchBegin;
     auto searchEnd = searchBegin + totalShards - 1;
-    searchEnd = searchEnd >= rx.size() : rx.size() - 1, searchEnd;
+    searchEnd = searchEnd >= int(rx.size()) ? int(rx.size()) - 1 : searchEnd;
 
     // 这里的逻辑是，我收到了一个fecPacket，那我得去看看这个fecPacket所在的block能不能decode了吧？
     // 利用systematic code的特性，解码成功的前提是至少有dataShards个packet，以避免不必要的检查操作
@@ -49,9 +49,10 @@ public:
     // 输入方向的函数
     static fecPacket Decode(byte *data, size_t sz);
 
-    // Input a FEC packet, and return recovered data if possible.
+    // Input a FEC packet received at "current" (ms, see currentMs), and return recovered
+    // data if possible. Packets older than fecExpire are dropped from the queue.
     // 译码还原丢失的数据包
-    std::vector<row_type> Input(fecPacket &pkt);
+    std::vector<row_type> Input(fecPacket &pkt, uint32_t current);
 
     // Mark raw array as typeData, and write correct size.
     void MarkData(byte *data, uint16_t sz);
@@ -60,11 +61,11 @@ public:
     void MarkFEC(byte *data);
 private:
     std::vector<fecPacket> rx; // ordered receive queue
-    int rxlimit;
-    int dataShards, parityShards, totalShards;
+    int rxlimit{0};
+    int dataShards{0}, parityShards{0}, totalShards{0};
     uint32_t next{0}; // next used seqid
     ReedSolomon enc;
-    uint32_t paws;  // Protect Against Wrapped Sequence numbers
+    uint32_t paws{0};  // Protect Against Wrapped Sequence numbers
     uint32_t lastCheck{0};
 };
 
@@ -61,7 +61,7 @@ int main() {
         } else {
             pkt.flag = typeFEC;
         }
-        auto recovered = fec.Input(pkt);
+        auto recovered = fec.Input(pkt, 0);
 
         if (recovered.size() > 0) {
             std::cout << "recovered:" << std::endl;
@@ -117,7 +117,7 @@ int main() {
         } else {
             pkt.flag = typeFEC;
         }
-        auto recovered = fec.Input(pkt);
+        auto recovered = fec.Input(pkt, 0);
 
         if (recovered.size() > 0) {
             std::cout << "recovered:" << std::endl;
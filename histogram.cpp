@@ -0,0 +1,92 @@
+#include "histogram.h"
+#include <algorithm>
+
+size_t
+Histogram::bucket(uint32_t v) noexcept {
+    if (v < 2 * histSubCount) {
+        return v;
+    }
+    // v has its top bit at "msb", keep the histSubBits+1 bits from there
+    int msb = 31 - __builtin_clz(v);
+    int shift = msb - histSubBits;
+    return size_t(shift) * histSubCount + (v >> shift);
+}
+
+uint32_t
+Histogram::highest(size_t i) noexcept {
+    if (i < 2 * histSubCount) {
+        return uint32_t(i);
+    }
+    size_t shift = i / histSubCount - 1;
+    uint64_t low = uint64_t(i - shift * histSubCount) << shift;
+    return uint32_t(low + (uint64_t(1) << shift) - 1);
+}
+
+void
+Histogram::Record(uint32_t v) noexcept {
+    if (m_counts.empty()) {
+        m_counts.resize(histBuckets);
+    }
+    m_counts[bucket(v)]++;
+    m_count++;
+    m_sum += v;
+    if (v < m_min) {
+        m_min = v;
+    }
+    if (v > m_max) {
+        m_max = v;
+    }
+}
+
+void
+Histogram::Merge(const Histogram &other) noexcept {
+    if (other.m_count == 0) {
+        return;
+    }
+    if (m_counts.empty()) {
+        m_counts.resize(histBuckets);
+    }
+    for (size_t i = 0; i < histBuckets; i++) {
+        m_counts[i] += other.m_counts[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_min < m_min) {
+        m_min = other.m_min;
+    }
+    if (other.m_max > m_max) {
+        m_max = other.m_max;
+    }
+}
+
+void
+Histogram::Reset() noexcept {
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    m_count = 0;
+    m_sum = 0;
+    m_min = UINT32_MAX;
+    m_max = 0;
+}
+
+uint32_t
+Histogram::Percentile(double p) const noexcept {
+    if (m_count == 0) {
+        return 0;
+    }
+    uint64_t rank = p > 0 ? uint64_t(p * double(m_count) + 0.5) : 1;
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > m_count) {
+        rank = m_count;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histBuckets; i++) {
+        seen += m_counts[i];
+        if (seen >= rank) {
+            uint32_t v = highest(i);
+            return v < m_max ? v : m_max;
+        }
+    }
+    return m_max;
+}
@@ -0,0 +1,55 @@
+#ifndef KCP_HISTOGRAM_H
+#define KCP_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+const int histSubBits = 5;                                  // 32 sub-buckets per power of two
+const size_t histSubCount = size_t(1) << histSubBits;
+const size_t histBuckets = (32 - histSubBits) * histSubCount + histSubCount;
+
+// Histogram counts uint32 values (e.g. latencies in microseconds) in log-linear
+// buckets, HdrHistogram style: values below 2*histSubCount are exact, above that every
+// power of two is split into histSubCount buckets, so a bucket is at most 1/32 (~3%)
+// of its value wide. Recording is an index computation and an increment, the counters
+// are allocated on the first Record. Histograms with the same layout merge by adding
+// counters, e.g. to aggregate sessions.
+class Histogram {
+public:
+    // Record counts one value.
+    void Record(uint32_t v) noexcept;
+
+    // Merge adds the values recorded in "other".
+    void Merge(const Histogram &other) noexcept;
+
+    // Reset forgets all values, the counters are kept.
+    void Reset() noexcept;
+
+    // Percentile returns the value below or at which "p" (0 to 1) of the values lie,
+    // as the upper end of its bucket but no more than Max, 0 if nothing was recorded.
+    uint32_t Percentile(double p) const noexcept;
+
+    inline uint64_t Count() const noexcept { return m_count; }
+
+    inline uint32_t Min() const noexcept { return m_count > 0 ? m_min : 0; }
+
+    inline uint32_t Max() const noexcept { return m_max; }
+
+    inline double Mean() const noexcept { return m_count > 0 ? double(m_sum) / double(m_count) : 0; }
+
+private:
+    // bucket returns the index of the bucket holding "v".
+    static size_t bucket(uint32_t v) noexcept;
+
+    // highest returns the largest value in bucket "i".
+    static uint32_t highest(size_t i) noexcept;
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count{0};
+    uint64_t m_sum{0};
+    uint32_t m_min{UINT32_MAX};
+    uint32_t m_max{0};
+};
+
+#endif //KCP_HISTOGRAM_H
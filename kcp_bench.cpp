@@ -0,0 +1,375 @@
+//
+// kcp_bench measures bulk goodput, small message rtt, cpu time per GB and allocations
+// per message for every combination of the options given, over loopback udp and over
+// an in-memory EmuLink, and prints one JSON object (or CSV row) per combination.
+//
+//   kcp_bench -transport mem,loopback -mtu 1400 -wnd 128,1024 -nodelay 0,1 -stream 0,1 -fec 0:0,10:3
+//
+// Both peers live in this process. Loopback sessions are driven by an EventLoop, memory
+// sessions by calling Update back to back, so cpu time covers sender and receiver.
+//
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#include <sys/resource.h>
+#include "sess.h"
+#include "listener.h"
+#include "eventloop.h"
+#include "emulator.h"
+
+static uint64_t g_allocs = 0;
+
+void *operator new(size_t sz) {
+    g_allocs++;
+    void *p = malloc(sz);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+static void *
+countingMalloc(size_t sz) {
+    g_allocs++;
+    return malloc(sz);
+}
+
+static uint64_t
+monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+static uint64_t
+cpuNs() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t(ru.ru_utime.tv_sec) + uint64_t(ru.ru_stime.tv_sec)) * 1000000000 +
+           (uint64_t(ru.ru_utime.tv_usec) + uint64_t(ru.ru_stime.tv_usec)) * 1000;
+}
+
+struct config {
+    std::string transport;
+    int mtu;
+    int wnd;
+    int nodelay;
+    int stream;
+    int dataShards;
+    int parityShards;
+};
+
+struct result {
+    bool ok;                // the pair connected
+    bool complete;          // all bulk bytes arrived before the timeout
+    double seconds;
+    uint64_t bytes;
+    uint64_t messages;
+    double goodput;         // MB/s
+    double cpuPerGB;        // cpu seconds per GB received
+    double allocsPerMsg;
+    uint64_t rtt[5];        // p50 p90 p99 p99.9 max in us
+    uint64_t retrans;
+};
+
+// benchPair is a connected sender "a" and receiver "b" over one of the transports.
+class benchPair {
+public:
+    benchPair(const config &c) : m_cfg(c) {}
+
+    ~benchPair() {
+        UDPSession::Destroy(a);
+        UDPSession::Destroy(b);
+        UDPListener::Destroy(m_listener);
+        EventLoop::Destroy(m_loop);
+        EmuLink::Destroy(m_link);
+    }
+
+    bool open() {
+        size_t ds = size_t(m_cfg.dataShards), ps = size_t(m_cfg.parityShards);
+        if (m_cfg.transport == "mem") {
+            LinkProfile p{};
+            m_link = EmuLink::New(p, p, 1);
+            a = UDPSession::DialTransport(m_link->Endpoint(0), 1, ds, ps);
+            b = UDPSession::DialTransport(m_link->Endpoint(1), 1, ds, ps);
+            if (b == nullptr || setup(b) < 0) {
+                return false;
+            }
+        } else if (m_cfg.transport == "loopback") {
+            m_loop = EventLoop::Create();
+            m_listener = UDPListener::ListenWithOptions("127.0.0.1", 0, ds, ps);
+            if (m_loop == nullptr || m_listener == nullptr || m_loop->Add(m_listener) < 0) {
+                return false;
+            }
+            a = UDPSession::DialWithOptions("127.0.0.1", m_listener->Port(), ds, ps);
+            if (a == nullptr || m_loop->Add(a) < 0) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        if (a == nullptr || setup(a) < 0) {
+            return false;
+        }
+
+        // the listener creates "b" on the first datagram
+        a->Write("hello", 5);
+        char buf[8];
+        uint64_t deadline = monotonicNs() + 2000000000ULL;
+        while (monotonicNs() < deadline) {
+            poll();
+            if (b == nullptr && m_listener != nullptr) {
+                b = m_listener->Accept();
+            }
+            if (b != nullptr && b->Read(buf, sizeof(buf)) == 5) {
+                return m_listener == nullptr || setup(b) == 0;
+            }
+        }
+        return false;
+    }
+
+    // poll runs one round of both peers
+    void poll() {
+        if (m_loop != nullptr) {
+            m_loop->RunOnce(1);
+            return;
+        }
+        uint32_t now = currentMs();
+        a->Update(now);
+        b->Update(now);
+    }
+
+    // allocations of the emulator, which are not the library's: every queued copy of
+    // a datagram is a payload vector and a node of the in-flight map
+    uint64_t emuAllocs() const {
+        if (m_link == nullptr) {
+            return 0;
+        }
+        uint64_t n = 0;
+        for (int side = 0; side < 2; side++) {
+            EmuStats st = m_link->GetStats(side);
+            n += 2 * (st.sent - st.lost - st.queueDrops + st.duplicated);
+        }
+        return n;
+    }
+
+    UDPSession *a{nullptr};
+    UDPSession *b{nullptr};
+
+private:
+    int setup(UDPSession *s) {
+        if (m_cfg.nodelay) {
+            s->NoDelay(1, 10, 2, 1);
+        } else {
+            s->NoDelay(0, 10, 0, 0);
+        }
+        s->WndSize(m_cfg.wnd, m_cfg.wnd);
+        s->SetStreamMode(m_cfg.stream != 0);
+        return s->SetMtu(m_cfg.mtu);
+    }
+
+    config m_cfg;
+    EmuLink *m_link{nullptr};
+    UDPListener *m_listener{nullptr};
+    EventLoop *m_loop{nullptr};
+};
+
+static result
+run(const config &c, uint64_t total, size_t msgSize, size_t pings, double timeout) {
+    result r{};
+    benchPair p(c);
+    if (!p.open()) {
+        return r;
+    }
+    r.ok = true;
+
+    // bulk
+    std::vector<char> wbuf(msgSize, 'b');
+    std::vector<char> rbuf(msgSize > 65536 ? msgSize : 65536);
+    uint64_t sent = 0, recv = 0;
+    uint64_t allocs = g_allocs, emu = p.emuAllocs();
+    uint64_t cpu = cpuNs(), start = monotonicNs();
+    uint64_t deadline = start + uint64_t(timeout * 1e9);
+    while (recv < total && monotonicNs() < deadline) {
+        while (sent < total && p.a->Writable()) {
+            p.a->Write(wbuf.data(), msgSize);
+            sent += msgSize;
+            r.messages++;
+        }
+        p.poll();
+        ssize_t n;
+        while ((n = p.b->Read(rbuf.data(), rbuf.size())) > 0) {
+            recv += uint64_t(n);
+        }
+    }
+    uint64_t elapsed = monotonicNs() - start;
+    cpu = cpuNs() - cpu;
+    allocs = g_allocs - allocs - (p.emuAllocs() - emu);
+
+    r.complete = recv >= total;
+    r.bytes = recv;
+    r.seconds = double(elapsed) / 1e9;
+    r.goodput = double(recv) / 1e6 / r.seconds;
+    r.cpuPerGB = recv > 0 ? double(cpu) / 1e9 / (double(recv) / 1e9) : 0;
+    r.allocsPerMsg = r.messages > 0 ? double(allocs) / double(r.messages) : 0;
+    r.retrans = p.a->GetStats().retransSegs;
+
+    // ping-pong of small messages, one in flight
+    std::vector<uint64_t> rtts;
+    char ping[64];
+    memset(ping, 'p', sizeof(ping));
+    for (size_t i = 0; i < pings && r.complete; i++) {
+        uint64_t t0 = monotonicNs();
+        uint64_t limit = t0 + 1000000000ULL;
+        bool back = false;
+        p.a->Write(ping, sizeof(ping));
+        size_t got = 0;
+        while (got < sizeof(ping) && monotonicNs() < limit) {
+            p.poll();
+            ssize_t n;
+            while ((n = p.b->Read(rbuf.data(), rbuf.size())) > 0) {
+                got += size_t(n);
+            }
+        }
+        if (got >= sizeof(ping)) {
+            p.b->Write(ping, sizeof(ping));
+            got = 0;
+            while (got < sizeof(ping) && monotonicNs() < limit) {
+                p.poll();
+                ssize_t n;
+                while ((n = p.a->Read(rbuf.data(), rbuf.size())) > 0) {
+                    got += size_t(n);
+                }
+            }
+            back = got >= sizeof(ping);
+        }
+        if (!back) {
+            break;
+        }
+        rtts.push_back((monotonicNs() - t0) / 1000);
+    }
+    if (!rtts.empty()) {
+        std::sort(rtts.begin(), rtts.end());
+        const double q[4] = {0.5, 0.9, 0.99, 0.999};
+        for (int i = 0; i < 4; i++) {
+            r.rtt[i] = rtts[size_t(q[i] * double(rtts.size() - 1))];
+        }
+        r.rtt[4] = rtts.back();
+    }
+    return r;
+}
+
+static std::vector<std::string>
+split(const char *s) {
+    std::vector<std::string> out;
+    std::string cur;
+    for (; *s; s++) {
+        if (*s == ',') {
+            out.push_back(cur);
+            cur.clear();
+        } else {
+            cur += *s;
+        }
+    }
+    out.push_back(cur);
+    return out;
+}
+
+static std::vector<int>
+splitInts(const char *s) {
+    std::vector<int> out;
+    for (auto &v : split(s)) {
+        out.push_back(atoi(v.c_str()));
+    }
+    return out;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> transports{"mem", "loopback"};
+    std::vector<int> mtus{1400}, wnds{128, 1024}, nodelays{0, 1}, streams{0, 1};
+    std::vector<std::pair<int, int>> fecs{{0, 0}, {10, 3}};
+    uint64_t total = 32 << 20;
+    size_t msgSize = 4096, pings = 500;
+    double timeout = 5;
+    bool csv = false;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *k = argv[i], *v = argv[i + 1];
+        if (!strcmp(k, "-transport")) transports = split(v);
+        else if (!strcmp(k, "-mtu")) mtus = splitInts(v);
+        else if (!strcmp(k, "-wnd")) wnds = splitInts(v);
+        else if (!strcmp(k, "-nodelay")) nodelays = splitInts(v);
+        else if (!strcmp(k, "-stream")) streams = splitInts(v);
+        else if (!strcmp(k, "-fec")) {
+            fecs.clear();
+            for (auto &f : split(v)) {
+                int d = 0, p = 0;
+                sscanf(f.c_str(), "%d:%d", &d, &p);
+                fecs.emplace_back(d, p);
+            }
+        } else if (!strcmp(k, "-bytes")) total = strtoull(v, nullptr, 10);
+        else if (!strcmp(k, "-msg")) msgSize = strtoul(v, nullptr, 10);
+        else if (!strcmp(k, "-pings")) pings = strtoul(v, nullptr, 10);
+        else if (!strcmp(k, "-timeout")) timeout = atof(v);
+        else if (!strcmp(k, "-format")) csv = !strcmp(v, "csv");
+        else {
+            fprintf(stderr, "usage: %s [-transport mem,loopback] [-mtu list] [-wnd list] [-nodelay list]\n"
+                            "  [-stream list] [-fec data:parity,...] [-bytes n] [-msg bytes] [-pings n]\n"
+                            "  [-timeout s] [-format json|csv]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (msgSize == 0) {
+        msgSize = 1;
+    }
+    ikcp_allocator(countingMalloc, free);
+
+    if (csv) {
+        printf("transport,mtu,wnd,nodelay,stream,data_shards,parity_shards,ok,complete,bytes,seconds,"
+               "goodput_mbs,cpu_s_per_gb,allocs_per_msg,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_p999_us,"
+               "rtt_max_us,retrans\n");
+    } else {
+        printf("[\n");
+    }
+    bool first = true;
+    for (auto &t : transports)
+        for (int mtu : mtus)
+            for (int wnd : wnds)
+                for (int nd : nodelays)
+                    for (int st : streams)
+                        for (auto &f : fecs) {
+                            config c{t, mtu, wnd, nd, st, f.first, f.second};
+                            result r = run(c, total, msgSize, pings, timeout);
+                            if (csv) {
+                                printf("%s,%d,%d,%d,%d,%d,%d,%d,%d,%lu,%.3f,%.2f,%.3f,%.2f,%lu,%lu,%lu,%lu,%lu,%lu\n",
+                                       t.c_str(), mtu, wnd, nd, st, f.first, f.second, int(r.ok), int(r.complete),
+                                       r.bytes, r.seconds, r.goodput, r.cpuPerGB, r.allocsPerMsg,
+                                       r.rtt[0], r.rtt[1], r.rtt[2], r.rtt[3], r.rtt[4], r.retrans);
+                            } else {
+                                printf("%s  {\"transport\": \"%s\", \"mtu\": %d, \"wnd\": %d, \"nodelay\": %d, "
+                                       "\"stream\": %d, \"data_shards\": %d, \"parity_shards\": %d, \"ok\": %s, "
+                                       "\"complete\": %s, \"bytes\": %lu, \"seconds\": %.3f, \"goodput_mbs\": %.2f, "
+                                       "\"cpu_s_per_gb\": %.3f, \"allocs_per_msg\": %.2f, \"rtt_us\": {\"p50\": %lu, "
+                                       "\"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}, \"retrans\": %lu}",
+                                       first ? "" : ",\n", t.c_str(), mtu, wnd, nd, st, f.first, f.second,
+                                       r.ok ? "true" : "false", r.complete ? "true" : "false", r.bytes, r.seconds,
+                                       r.goodput, r.cpuPerGB, r.allocsPerMsg, r.rtt[0], r.rtt[1], r.rtt[2],
+                                       r.rtt[3], r.rtt[4], r.retrans);
+                            }
+                            fflush(stdout);
+                            first = false;
+                        }
+    if (!csv) {
+        printf("\n]\n");
+    }
+    return 0;
+}
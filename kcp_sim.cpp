@@ -0,0 +1,279 @@
+//
+// kcp_sim runs many session pairs (kcp and FEC) over emulated links in virtual time.
+// Every pair sends messages from side 0 to side 1, the simulator jumps from one event
+// (an Update deadline from Check, an arrival, the next message) to the next, so idle
+// time costs nothing. It reports aggregate goodput and the latency distribution.
+//
+//   kcp_sim -n 10000 -t 30 -rate 50 -size 1000 -delay 20 -loss 1 -fec 10,3
+//
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <time.h>
+#include <vector>
+#include "sess.h"
+#include "emulator.h"
+
+const uint64_t simStart = 1000000000000ULL;    // virtual clock at start, ns
+const uint64_t latBucketUs = 100;               // latency histogram resolution
+const size_t latBuckets = 100000;               // up to 10 s, the last bucket takes the rest
+
+struct options {
+    size_t conns{1000};
+    double seconds{10};
+    double rate{50};        // messages per second and connection, 0 sends as fast as the window allows
+    size_t size{1000};      // message size, at least 8 for the send time
+    double delayMs{20};     // one-way
+    double jitterMs{0};
+    double lossPct{0};
+    double burstPct{0};     // loss in the Gilbert-Elliott bad state, 0 is off
+    double bwMbit{0};
+    size_t queueKB{0};
+    int dataShards{0};
+    int parityShards{0};
+    int nodelay{1};
+    int interval{10};
+    int wnd{128};
+    uint64_t seed{1};
+};
+
+struct endpoint {
+    UDPSession *sess;
+    uint64_t due;           // armed wake-up in clock us, 0 if none
+};
+
+struct conn {
+    EmuLink *link;
+    endpoint ep[2];
+    uint64_t nextMsg;       // send time of the next message in clock us
+};
+
+struct event {
+    uint64_t t;
+    uint32_t id;            // connection * 2 + side
+
+    bool operator>(const event &other) const { return t > other.t; }
+};
+
+typedef std::priority_queue<event, std::vector<event>, std::greater<event>> eventQueue;
+
+static uint64_t
+wallUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+}
+
+static void
+schedule(eventQueue &events, endpoint &ep, uint32_t id, uint64_t t) {
+    if (ep.due != 0 && ep.due <= t) {
+        return; // an earlier wake-up is already armed
+    }
+    ep.due = t;
+    events.push(event{t, id});
+}
+
+static uint64_t
+percentile(const std::vector<uint64_t> &hist, uint64_t total, double p) {
+    uint64_t rank = uint64_t(double(total) * p);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < hist.size(); i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return (i + 1) * latBucketUs;
+        }
+    }
+    return hist.size() * latBucketUs;
+}
+
+static bool
+parse(int argc, char **argv, options &o) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *k = argv[i], *v = argv[i + 1];
+        if (!strcmp(k, "-n")) o.conns = strtoul(v, nullptr, 10);
+        else if (!strcmp(k, "-t")) o.seconds = atof(v);
+        else if (!strcmp(k, "-rate")) o.rate = atof(v);
+        else if (!strcmp(k, "-size")) o.size = strtoul(v, nullptr, 10);
+        else if (!strcmp(k, "-delay")) o.delayMs = atof(v);
+        else if (!strcmp(k, "-jitter")) o.jitterMs = atof(v);
+        else if (!strcmp(k, "-loss")) o.lossPct = atof(v);
+        else if (!strcmp(k, "-burst")) o.burstPct = atof(v);
+        else if (!strcmp(k, "-bw")) o.bwMbit = atof(v);
+        else if (!strcmp(k, "-queue")) o.queueKB = strtoul(v, nullptr, 10);
+        else if (!strcmp(k, "-fec")) sscanf(v, "%d,%d", &o.dataShards, &o.parityShards);
+        else if (!strcmp(k, "-nodelay")) o.nodelay = atoi(v);
+        else if (!strcmp(k, "-interval")) o.interval = atoi(v);
+        else if (!strcmp(k, "-wnd")) o.wnd = atoi(v);
+        else if (!strcmp(k, "-seed")) o.seed = strtoull(v, nullptr, 10);
+        else return false;
+    }
+    return argc % 2 == 1 && o.conns > 0 && o.size >= 8;
+}
+
+int main(int argc, char **argv) {
+    options o;
+    if (!parse(argc, argv, o)) {
+        fprintf(stderr, "usage: %s [-n conns] [-t seconds] [-rate msgs/s, 0 for bulk] [-size bytes]\n"
+                        "  [-delay ms] [-jitter ms] [-loss %%] [-burst %%] [-bw mbit] [-queue KB]\n"
+                        "  [-fec data,parity] [-nodelay 0|1] [-interval ms] [-wnd n] [-seed n]\n", argv[0]);
+        return 2;
+    }
+
+    ManualClock clock(simStart);
+    SetClock(&clock);
+
+    LinkProfile profile{};
+    profile.delayUs = uint32_t(o.delayMs * 1000);
+    profile.jitterUs = uint32_t(o.jitterMs * 1000);
+    profile.loss = o.lossPct / 100;
+    if (o.burstPct > 0) {
+        profile.goodToBad = 0.01;
+        profile.badToGood = 0.3;
+        profile.burstLoss = o.burstPct / 100;
+    }
+    profile.rateBps = uint64_t(o.bwMbit * 1000000);
+    profile.queueBytes = o.queueKB * 1024;
+
+    uint64_t start = simStart / 1000;
+    uint64_t end = start + uint64_t(o.seconds * 1000000);
+    uint64_t period = o.rate > 0 ? uint64_t(1000000 / o.rate) : 0;
+
+    eventQueue events;
+    std::vector<conn> conns(o.conns);
+    for (size_t i = 0; i < o.conns; i++) {
+        conn &c = conns[i];
+        c.link = EmuLink::New(profile, profile, o.seed + i);
+        for (int side = 0; side < 2; side++) {
+            auto sess = UDPSession::DialTransport(c.link->Endpoint(side), uint32_t(i + 1),
+                                                  size_t(o.dataShards), size_t(o.parityShards));
+            if (o.nodelay) {
+                sess->NoDelay(1, o.interval, 2, 1);
+            } else {
+                sess->NoDelay(0, o.interval, 0, 0);
+            }
+            sess->WndSize(o.wnd, o.wnd);
+            c.ep[side] = endpoint{sess, 0};
+            schedule(events, c.ep[side], uint32_t(i * 2 + side), start);
+        }
+        // spread the first messages over one period, so that connections don't send in lockstep
+        c.nextMsg = start + (period > 0 ? period * i / o.conns : 0);
+    }
+
+    std::vector<char> msg(o.size, 'k');
+    std::vector<char> rbuf(o.size);
+    std::vector<uint64_t> hist(latBuckets);
+    uint64_t sentMsgs = 0, recvMsgs = 0, recvBytes = 0, updates = 0;
+    uint64_t wallStart = wallUs();
+
+    while (!events.empty() && events.top().t < end) {
+        event ev = events.top();
+        events.pop();
+        conn &c = conns[ev.id / 2];
+        int side = int(ev.id % 2);
+        endpoint &ep = c.ep[side];
+        if (ep.due != ev.t) {
+            continue;   // superseded by an earlier wake-up
+        }
+        ep.due = 0;
+
+        uint64_t now = ev.t;
+        clock.Set(now * 1000);
+
+        if (side == 0) {
+            if (period > 0) {
+                // stamped with the time it was due, so time queued in kcp counts
+                while (c.nextMsg <= now) {
+                    memcpy(msg.data(), &c.nextMsg, sizeof(uint64_t));
+                    ep.sess->Write(msg.data(), msg.size());
+                    c.nextMsg += period;
+                    sentMsgs++;
+                }
+            } else {
+                while (ep.sess->Writable()) {
+                    memcpy(msg.data(), &now, sizeof(uint64_t));
+                    ep.sess->Write(msg.data(), msg.size());
+                    sentMsgs++;
+                }
+            }
+        }
+
+        uint32_t ms = currentMs();
+        ep.sess->Update(ms);
+        updates++;
+
+        if (side == 1) {
+            ssize_t n;
+            while ((n = ep.sess->Read(rbuf.data(), rbuf.size())) > 0) {
+                uint64_t sent;
+                memcpy(&sent, rbuf.data(), sizeof(uint64_t));
+                uint64_t b = (now - sent) / latBucketUs;
+                hist[b < latBuckets ? b : latBuckets - 1]++;
+                recvMsgs++;
+                recvBytes += uint64_t(n);
+            }
+        }
+
+        // next kcp deadline, at least one tick ahead since Update just flushed. An idle
+        // session only has to wake for input, as in EventLoop, which keeps idle
+        // connections cheap.
+        uint64_t due = end;
+        if (!ep.sess->Idle()) {
+            int32_t wait = int32_t(ep.sess->Check(ms) - ms);
+            due = (now / 1000 + uint64_t(wait > 0 ? wait : 1)) * 1000;
+        }
+        if (side == 0 && period > 0 && c.nextMsg < due) {
+            due = c.nextMsg;
+        }
+        schedule(events, ep, ev.id, due);
+
+        // datagrams in flight either way wake their receiver on arrival
+        uint64_t in = c.link->NextArrival(1 - side);
+        if (in != 0) {
+            schedule(events, ep, ev.id, in);
+        }
+        uint64_t out = c.link->NextArrival(side);
+        if (out != 0) {
+            uint32_t peer = ev.id ^ 1;
+            schedule(events, c.ep[1 - side], peer, out);
+        }
+    }
+    double wall = double(wallUs() - wallStart) / 1e6;
+
+    EmuStats link{};
+    uint64_t retrans = 0, recovered = 0;
+    for (auto &c : conns) {
+        for (int side = 0; side < 2; side++) {
+            EmuStats st = c.link->GetStats(side);
+            link.sent += st.sent;
+            link.lost += st.lost;
+            link.queueDrops += st.queueDrops;
+            SessionStats ss = c.ep[side].sess->GetStats();
+            retrans += ss.retransSegs;
+            recovered += ss.fecRecovered;
+            UDPSession::Destroy(c.ep[side].sess);
+        }
+        EmuLink::Destroy(c.link);
+    }
+    SetClock(nullptr);
+
+    printf("conns %zu, %.1f s simulated in %.2f s wall (%.1fx), %lu updates\n",
+           o.conns, o.seconds, wall, o.seconds / wall, updates);
+    printf("messages %lu sent, %lu received, goodput %.3f Mbit/s total, %.3f Mbit/s per connection\n",
+           sentMsgs, recvMsgs, double(recvBytes) * 8 / o.seconds / 1e6,
+           double(recvBytes) * 8 / o.seconds / 1e6 / double(o.conns));
+    printf("datagrams %lu sent, %lu lost, %lu queue drops, %lu segments retransmitted, %lu recovered by FEC\n",
+           link.sent, link.lost, link.queueDrops, retrans, recovered);
+    if (recvMsgs > 0) {
+        printf("latency ms p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               percentile(hist, recvMsgs, 0.5) / 1e3, percentile(hist, recvMsgs, 0.9) / 1e3,
+               percentile(hist, recvMsgs, 0.99) / 1e3, percentile(hist, recvMsgs, 0.999) / 1e3,
+               percentile(hist, recvMsgs, 1) / 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,551 @@
+#include "listener.h"
+#include "eventloop.h"
+#include "uring.h"
+#include "xdp.h"
+#include "encoding.h"
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/fcntl.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+
+bool
+sessionKey::operator==(const sessionKey &other) const noexcept {
+    return memcmp(this, &other, sizeof(sessionKey)) == 0;
+}
+
+size_t
+sessionKeyHash::operator()(const sessionKey &key) const noexcept {
+    // FNV-1a over the whole key
+    auto p = reinterpret_cast<const uint8_t *>(&key);
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(sessionKey); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return size_t(h);
+}
+
+sessionKey
+UDPListener::makeKey(const struct sockaddr *addr, uint32_t conv) noexcept {
+    sessionKey key;
+    memset(&key, 0, sizeof(key));
+    key.conv = conv;
+    key.family = addr->sa_family;
+    if (addr->sa_family == AF_INET) {
+        auto in = reinterpret_cast<const struct sockaddr_in *>(addr);
+        key.port = in->sin_port;
+        memcpy(key.addr, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr->sa_family == AF_INET6) {
+        auto in6 = reinterpret_cast<const struct sockaddr_in6 *>(addr);
+        key.port = in6->sin6_port;
+        memcpy(key.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    return key;
+}
+
+sessionKey
+UDPListener::sessionOf(const struct sockaddr *addr, uint32_t conv) const noexcept {
+    if (!m_byConv) {
+        return makeKey(addr, conv);
+    }
+    sessionKey key;
+    memset(&key, 0, sizeof(key));
+    key.conv = conv;
+    return key;
+}
+
+UDPListener *
+UDPListener::Listen(const char *ip, uint16_t port) {
+    return UDPListener::listen(ip, port, false);
+}
+
+UDPListener *
+UDPListener::ListenReusePort(const char *ip, uint16_t port, size_t dataShards, size_t parityShards) {
+    auto l = UDPListener::listen(ip, port, true);
+    if (l == nullptr) {
+        return nullptr;
+    }
+
+    if (dataShards > 0 && parityShards > 0) {
+        l->dataShards = dataShards;
+        l->parityShards = parityShards;
+    }
+    return l;
+}
+
+UDPListener *
+UDPListener::listen(const char *ip, uint16_t port, bool reuseport) {
+    struct sockaddr_storage saddr;
+    socklen_t saddrlen;
+    memset(&saddr, 0, sizeof(saddr));
+
+    auto in = reinterpret_cast<struct sockaddr_in *>(&saddr);
+    auto in6 = reinterpret_cast<struct sockaddr_in6 *>(&saddr);
+    if (inet_pton(AF_INET, ip, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        saddrlen = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, ip, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        saddrlen = sizeof(struct sockaddr_in6);
+    } else {
+        return nullptr;
+    }
+
+    int sockfd = socket(saddr.ss_family, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        return nullptr;
+    }
+    int opt = 1;
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        close(sockfd);
+        return nullptr;
+    }
+    if (bind(sockfd, (struct sockaddr *) &saddr, saddrlen) < 0) {
+        close(sockfd);
+        return nullptr;
+    }
+
+    return UDPListener::createListener(sockfd);
+}
+
+UDPListener *
+UDPListener::ListenWithOptions(const char *ip, uint16_t port, size_t dataShards, size_t parityShards) {
+    auto l = UDPListener::Listen(ip, port);
+    if (l == nullptr) {
+        return nullptr;
+    }
+
+    if (dataShards > 0 && parityShards > 0) {
+        l->dataShards = dataShards;
+        l->parityShards = parityShards;
+    }
+    return l;
+}
+
+UDPListener *
+UDPListener::createListener(int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(sockfd);
+        return nullptr;
+    }
+
+    UDPListener *l = new(UDPListener);
+    l->m_sockfd = sockfd;
+    l->m_io = new SocketTransport(sockfd);
+    l->m_io->SetTimestamps(true);
+    return l;
+}
+
+void
+UDPListener::Destroy(UDPListener *l) {
+    if (nullptr == l) return;
+    if (nullptr != l->m_loop) {
+        l->m_loop->dropWaiters(l);
+        l->m_loop->Remove(l);
+    }
+    dropWaiter(l->m_acceptWaiter);
+
+    // detach every session first, so that destroying them doesn't call back into the listener
+    for (auto &kv : l->m_sessions) {
+        kv.second->m_listener = nullptr;
+        kv.second->m_sockfd = -1;
+    }
+    for (auto sess : l->m_accepts) {
+        UDPSession::Destroy(sess);
+    }
+
+    if (nullptr != l->m_exporter) { l->m_exporter->Release(l->m_statsSlot); }
+    delete l->m_io;
+    AEAD::Destroy(l->m_aead);
+    if (0 < l->m_sockfd) { close(l->m_sockfd); }
+    delete l;
+}
+
+/*
+ * reuseport的cBPF程序运行时，数据从UDP payload开始，
+ * 返回值是reuseport组内socket的下标，越界则退回内核的四元组hash
+ */
+int
+UDPListener::SteerByConv(size_t groupSize) noexcept {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    // FEC parity shards carry no conv, the address hash would spread them over the
+    // group and every socket but one would drop them, so FEC is refused here. With a
+    // key the program would read sealed bytes, which steers at random.
+    if (groupSize == 0 || (dataShards > 0 && parityShards > 0) || m_aead != nullptr) {
+        return -1;
+    }
+
+    // conv is little endian, assemble it byte by byte
+    struct sock_filter code[] = {
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+            BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+            BPF_STMT(BPF_MISC | BPF_TAX, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+            BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+            BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+            BPF_STMT(BPF_MISC | BPF_TAX, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+            BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+            BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+            BPF_STMT(BPF_MISC | BPF_TAX, 0),
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+            BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, uint32_t(groupSize)),
+            BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    struct sock_fprog prog;
+    prog.len = (unsigned short) (sizeof(code) / sizeof(code[0]));
+    prog.filter = code;
+    if (setsockopt(m_sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        return -1;
+    }
+
+    // key the sessions already there by conv alone as well
+    if (!m_byConv) {
+        m_byConv = true;
+        decltype(m_sessions) sessions;
+        for (auto &kv : m_sessions) {
+            sessions.emplace(sessionOf(nullptr, kv.first.conv), kv.second);
+        }
+        m_sessions.swap(sessions);
+    }
+    return 0;
+#else
+    (void) groupSize;
+    return -1;
+#endif
+}
+
+uint16_t
+UDPListener::Port() const noexcept {
+    struct sockaddr_storage saddr;
+    socklen_t saddrlen = sizeof(saddr);
+    if (getsockname(m_sockfd, (struct sockaddr *) &saddr, &saddrlen) < 0) {
+        return 0;
+    }
+    if (saddr.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<struct sockaddr_in6 *>(&saddr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<struct sockaddr_in *>(&saddr)->sin_port);
+}
+
+UDPSession *
+UDPListener::Accept() noexcept {
+    if (m_accepts.empty()) {
+        return nullptr;
+    }
+
+    auto sess = m_accepts.front();
+    m_accepts.pop_front();
+    return sess;
+}
+
+void
+UDPListener::AwaitAccept(Waiter w) noexcept {
+    m_acceptWaiter = w;
+}
+
+/*
+ * 监听socket上的所有数据都从这里读入，按照(地址, conv)找到对应的会话，
+ * 找不到则新建会话并放入accept队列，随后统一驱动所有会话的flush
+ */
+void
+UDPListener::Update(uint32_t current) noexcept {
+    receive(nullptr, current);
+
+    for (auto &kv : m_sessions) {
+        kv.second->Update(current);
+    }
+    flush(current);
+}
+
+void
+UDPListener::receive(std::vector<UDPSession *> *touched, uint32_t current) noexcept {
+    for (;;) {
+        Datagram *dgrams;
+        bool more;
+        int n = m_io->Recv(&dgrams, &more);
+        if (m_aead != nullptr && n > 0) {
+            // conv is sealed too, so the batch is opened before dispatching
+            int opened = m_aead->OpenBatch(dgrams, n);
+            m_stats.cryptErrs += uint64_t(n - opened);
+            n = opened;
+        }
+        uint64_t now = n > 0 ? realtimeNs() : 0;
+        for (int i = 0; i < n; i++) {
+            m_stats.inPkts++;
+            m_stats.inBytes += dgrams[i].len;
+            auto sess = dispatch(dgrams[i], current, queueDelay(dgrams[i], now));
+            if (touched != nullptr && sess != nullptr && !sess->m_touched) {
+                sess->m_touched = true;
+                touched->push_back(sess);
+            }
+        }
+        if (!more) {
+            break;
+        }
+    }
+}
+
+void
+UDPListener::flush(uint32_t current) noexcept {
+    m_io->Flush();
+
+    if (m_exporter != nullptr) {
+        auto stats = GetStats();
+        m_exporter->Publish(m_statsSlot, &stats, sizeof(stats), current);
+    }
+}
+
+UDPSession *
+UDPListener::dispatch(const Datagram &d, uint32_t current, uint32_t delay) noexcept {
+    byte *data = d.data;
+    size_t n = d.len;
+    const struct sockaddr *addr = d.addr;
+    socklen_t addrlen = d.addrlen;
+    bool fecEnabled = dataShards > 0 && parityShards > 0;
+
+    // locate conv: [conv] ... without FEC, [seqid] [flag] [sz] [conv] ... for FEC data shards,
+    // parity shards carry no conv at all, path mtu probes start with it in both modes.
+    bool hasConv = false;
+    bool probe = n >= probeHeaderSize && data[4] == probeMark;
+    uint32_t conv = 0;
+    if (probe) {
+        conv = ikcp_getconv(data);
+        hasConv = true;
+    } else if (fecEnabled) {
+        if (n < fecHeaderSizePlus2) {
+            m_stats.dropped++;
+            return nullptr;
+        }
+        uint16_t flag;
+        decode16u(data + 4, &flag);
+        if (flag == typeData && n >= fecHeaderSizePlus2 + kcpHeaderSize) {
+            conv = ikcp_getconv(data + fecHeaderSizePlus2);
+            hasConv = true;
+        }
+    } else if (n >= kcpHeaderSize) {
+        conv = ikcp_getconv(data);
+        hasConv = true;
+    }
+
+    UDPSession *sess = nullptr;
+    if (hasConv) {
+        auto key = sessionOf(addr, conv);
+        auto it = m_sessions.find(key);
+        if (it != m_sessions.end()) {
+            sess = it->second;
+            if (m_byConv) {
+                migrate(sess, addr, addrlen);
+            }
+        } else {
+            if (probe || m_accepts.size() >= acceptBacklog) {
+                m_stats.dropped++;
+                return nullptr;
+            }
+            sess = UDPSession::acceptSession(this, addr, addrlen, conv);
+            m_sessions.emplace(key, sess);
+            m_accepts.push_back(sess);
+            m_stats.accepted++;
+        }
+
+        if (fecEnabled && !probe) {
+            m_byaddr[makeKey(addr, 0)] = sess;
+        }
+    } else if (fecEnabled) {
+        auto it = m_byaddr.find(makeKey(addr, 0));
+        if (it != m_byaddr.end()) {
+            sess = it->second;
+        }
+    }
+
+    if (sess == nullptr) {
+        m_stats.dropped++;
+        return nullptr;
+    }
+    sess->input(data, n, current, delay);
+    return sess;
+}
+
+void
+UDPListener::migrate(UDPSession *sess, const struct sockaddr *addr, socklen_t addrlen) noexcept {
+    if (sess->m_raddrlen == addrlen && memcmp(&sess->m_raddr, addr, addrlen) == 0) {
+        return;
+    }
+
+    auto it = m_byaddr.find(makeKey((const struct sockaddr *) &sess->m_raddr, 0));
+    if (it != m_byaddr.end() && it->second == sess) {
+        m_byaddr.erase(it);
+    }
+    memcpy(&sess->m_raddr, addr, addrlen);
+    sess->m_raddrlen = addrlen;
+    m_stats.migrated++;
+}
+
+void
+UDPListener::remove(UDPSession *sess) noexcept {
+    auto addr = (const struct sockaddr *) &sess->m_raddr;
+    m_sessions.erase(sessionOf(addr, sess->m_kcp->conv));
+
+    auto it = m_byaddr.find(makeKey(addr, 0));
+    if (it != m_byaddr.end() && it->second == sess) {
+        m_byaddr.erase(it);
+    }
+
+    auto pending = std::find(m_accepts.begin(), m_accepts.end(), sess);
+    if (pending != m_accepts.end()) {
+        m_accepts.erase(pending);
+    }
+}
+
+void
+UDPListener::SetRecvBatch(size_t n) noexcept {
+    m_io->SetRecvBatch(n);
+}
+
+int
+UDPListener::UseIOUring(unsigned entries, bool sqpoll) noexcept {
+    return setTransport(UringTransport::Create(m_sockfd, entries, sqpoll));
+}
+
+int
+UDPListener::UseXDP(const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) noexcept {
+    return setTransport(XdpTransport::Create(m_sockfd, ifname, queue, gwmac, native));
+}
+
+int
+UDPListener::setTransport(Transport *io) noexcept {
+    if (io == nullptr) {
+        return -1;
+    }
+
+    m_io->Flush();
+    if (m_loop != nullptr && m_loop->rebind(this, m_io->Fd(), io->Fd()) < 0) {
+        delete io;
+        return -1;
+    }
+    delete m_io;
+    m_io = io;
+    return 0;
+}
+
+int
+UDPListener::SetGRO(bool enable) noexcept {
+    return m_io->SetGRO(enable);
+}
+
+int
+UDPListener::SetRxTimestamps(bool enable) noexcept {
+    return m_io->SetTimestamps(enable);
+}
+
+void
+UDPListener::SetGSO(bool enable) noexcept {
+    m_io->SetGSO(enable);
+}
+
+void
+UDPListener::SetSockBufMax(size_t max) noexcept {
+    m_io->SetSockBufMax(max);
+}
+
+int
+UDPListener::SetKey(const byte *key, size_t keylen) noexcept {
+    if (m_byConv) {
+        return -1;  // the steering program would read the sealed nonce as conv
+    }
+
+    AEAD *c = AEAD::New(key, keylen);
+    if (c == nullptr) {
+        return -1;
+    }
+    AEAD::Destroy(m_aead);
+    m_aead = c;
+    return 0;
+}
+
+int
+UDPListener::SetDSCP(int iptos) noexcept {
+    iptos = (iptos << 2) & 0xFF;
+    return setsockopt(this->m_sockfd, IPPROTO_IP, IP_TOS, &iptos, sizeof(iptos));
+}
+
+int
+UDPListener::SetPathMTUDiscovery(size_t linkMtu) noexcept {
+    if (linkMtu > 0) {
+        if (pmtuSetDF(m_sockfd) < 0) {
+            return -1;
+        }
+        size_t iphdr = pmtuOverhead(m_sockfd);
+        if (linkMtu > iphdr) {
+            m_io->MaxDatagram(linkMtu - iphdr);
+        }
+    }
+
+    m_pmtuLink = linkMtu;
+    for (auto &kv : m_sessions) {
+        kv.second->SetPathMTUDiscovery(linkMtu);
+    }
+    return 0;
+}
+
+int
+UDPListener::SetBusyPoll(int usecs) noexcept {
+    m_busyPoll = usecs > 0;
+    for (auto &kv : m_sessions) {
+        kv.second->m_busyPoll = m_busyPoll;
+    }
+
+    int prefer = usecs > 0 ? 1 : 0;
+    if (setsockopt(m_sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    return setsockopt(m_sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#else
+    (void) prefer;
+    return 0;
+#endif
+}
+
+ListenerStats
+UDPListener::GetStats() const noexcept {
+    ListenerStats stats = m_stats;
+    stats.sessions = uint32_t(m_sessions.size());
+    stats.pending = uint32_t(m_accepts.size());
+    stats.rxDrops = m_io->RxDrops();
+    stats.txDrops = m_io->TxDrops();
+    return stats;
+}
+
+int
+UDPListener::SetStatsExporter(StatsExporter *exp) noexcept {
+    if (m_exporter != nullptr) {
+        m_exporter->Release(m_statsSlot);
+        m_exporter = nullptr;
+        m_statsSlot = -1;
+    }
+
+    if (exp == nullptr) {
+        return 0;
+    }
+
+    int slot = exp->Acquire(statsKindListener);
+    if (slot < 0) {
+        return -1;
+    }
+    m_exporter = exp;
+    m_statsSlot = slot;
+    return 0;
+}
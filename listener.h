@@ -0,0 +1,205 @@
+#ifndef KCP_LISTENER_H
+#define KCP_LISTENER_H
+
+#include "sess.h"
+#include <deque>
+#include <unordered_map>
+#include <netinet/in.h>
+
+class EventLoop;
+
+const size_t acceptBacklog = 128;   // max sessions waiting for Accept
+
+// sessionKey identifies a session by remote address and conv,
+// addresses are stored in a canonical form so that memcmp is enough.
+struct sessionKey {
+    uint32_t conv;
+    uint16_t family;
+    uint16_t port;
+    uint8_t addr[16];
+
+    bool operator==(const sessionKey &other) const noexcept;
+};
+
+struct sessionKeyHash {
+    size_t operator()(const sessionKey &key) const noexcept;
+};
+
+struct ListenerStats {
+    uint32_t sessions;      // sessions currently alive
+    uint32_t pending;       // sessions waiting for Accept
+    uint64_t inPkts;
+    uint64_t inBytes;
+    uint64_t accepted;      // sessions created
+    uint64_t dropped;       // datagrams not belonging to any session
+    uint64_t cryptErrs;     // datagrams failing authentication
+    uint64_t rxDrops;       // datagrams dropped by the local kernel on a full receive queue
+    uint64_t txDrops;       // datagrams the local kernel refused to send
+    uint64_t migrated;      // sessions moved to a new peer address, see SteerByConv
+};
+
+static_assert(sizeof(ListenerStats) <= statsPayloadSize, "ListenerStats exceeds slot payload");
+
+class UDPListener {
+private:
+    int m_sockfd{0};
+    Transport *m_io{nullptr};   // shared by all sessions, output is sent at the end of Update
+    AEAD *m_aead{nullptr};      // shared by all sessions
+    size_t dataShards{0};
+    size_t parityShards{0};
+    bool m_busyPoll{false};     // passed on to accepted sessions
+    size_t m_pmtuLink{0};       // path mtu discovery for accepted sessions, 0 if off
+    bool m_byConv{false};       // set by SteerByConv, sessions are keyed by conv alone
+
+    // sessions by (address, conv), or by conv alone with SteerByConv, every lookup is O(1)
+    std::unordered_map<sessionKey, UDPSession *, sessionKeyHash> m_sessions;
+    // latest session by address only, for FEC parity shards which carry no conv
+    std::unordered_map<sessionKey, UDPSession *, sessionKeyHash> m_byaddr;
+    std::deque<UDPSession *> m_accepts;
+
+    EventLoop *m_loop{nullptr};
+    Waiter m_acceptWaiter{};    // resumed by the event loop once Accept has a session
+
+    ListenerStats m_stats{};
+    StatsExporter *m_exporter{nullptr};
+    int m_statsSlot{-1};
+public:
+    UDPListener(const UDPListener &) = delete;
+
+    UDPListener &operator=(const UDPListener &) = delete;
+
+    // Listen binds a udp socket on ip:port and returns UDPListener.
+    static UDPListener *Listen(const char *ip, uint16_t port);
+
+    // ListenWithOptions is Listen with FEC enabled for every accepted session.
+    static UDPListener *ListenWithOptions(const char *ip, uint16_t port, size_t dataShards, size_t parityShards);
+
+    // ListenReusePort is ListenWithOptions with SO_REUSEPORT set, so that several
+    // listeners (one per thread) can bind the same ip:port and share its traffic.
+    static UDPListener *ListenReusePort(const char *ip, uint16_t port, size_t dataShards, size_t parityShards);
+
+    // Destroy release all resource related. Sessions not accepted yet are destroyed,
+    // accepted sessions are detached and can no longer send, destroy them first.
+    static void Destroy(UDPListener *l);
+
+    // SteerByConv attaches a classic BPF program to the SO_REUSEPORT group of this
+    // socket which picks socket "conv % groupSize" for every datagram, and keys the
+    // sessions of this listener by conv alone. A session then survives a change of the
+    // peer address (e.g. a NAT rebinding): it stays on its socket, and its remote
+    // address moves to the one the latest datagram carrying its conv came from.
+    // Call it on every listener of the group before sessions arrive.
+    //
+    // Returns -1 on a listener with FEC, parity shards carry no conv so they could
+    // not follow their session's socket, and on a listener with a key, see SetKey.
+    int SteerByConv(size_t groupSize) noexcept;
+
+    // Port returns the local port the listener is bound to.
+    uint16_t Port() const noexcept;
+
+    // Accept returns the next new session, or nullptr if there is none.
+    // The caller owns the session and releases it with UDPSession::Destroy.
+    UDPSession *Accept() noexcept;
+
+    // AwaitAccept registers "w" to be resumed by the listener's event loop as soon as
+    // Accept has a session, a new waiter replaces the old one.
+    void AwaitAccept(Waiter w) noexcept;
+
+    // Pending returns the number of sessions waiting for Accept.
+    inline size_t Pending() const noexcept { return m_accepts.size(); }
+
+    // Update reads all pending datagrams, dispatches them to their sessions,
+    // updates every session and sends their output, pass currentMs().
+    void Update(uint32_t current) noexcept;
+
+    // SetRecvBatch sets how many datagrams are read per recvmmsg, default defaultRecvBatch.
+    void SetRecvBatch(size_t n) noexcept;
+
+    // SetGRO toggles receiving coalesced runs of datagrams in one buffer (UDP_GRO),
+    // returns the setsockopt result.
+    int SetGRO(bool enable) noexcept;
+
+    // UseIOUring switches to the io_uring backend (multishot recvmsg on a provided
+    // buffer ring, batched sendmsg), optionally with a kernel SQPOLL thread.
+    // Returns -1 if the kernel lacks support, the socket backend is kept then.
+    // GRO and GSO are not available on this backend.
+    int UseIOUring(unsigned entries, bool sqpoll) noexcept;
+
+    // UseXDP switches to an AF_XDP socket on queue "queue" of "ifname", bypassing the
+    // kernel udp stack for ipv4 traffic to the local address, see XdpTransport.
+    // "gwmac" is the next hop for destinations which have not been heard from yet.
+    int UseXDP(const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) noexcept;
+
+    // SetRxTimestamps toggles kernel receive timestamps (SO_TIMESTAMPNS), on by default,
+    // see UDPSession::SetRxTimestamps.
+    int SetRxTimestamps(bool enable) noexcept;
+
+    // SetGSO toggles sending runs of equal-size datagrams as one UDP_SEGMENT super-buffer.
+    void SetGSO(bool enable) noexcept;
+
+    // SetSockBufMax caps the shared socket buffers, see UDPSession::SetSockBufMax.
+    void SetSockBufMax(size_t max) noexcept;
+
+    // SetKey seals every datagram of every session with ChaCha20-Poly1305, see
+    // UDPSession::SetKey. conv is encrypted then and can't be steered by, so SetKey
+    // returns -1 after SteerByConv, and SteerByConv fails after SetKey.
+    int SetKey(const byte *key, size_t keylen) noexcept;
+
+    // Set DSCP value
+    int SetDSCP(int dscp) noexcept;
+
+    // SetPathMTUDiscovery sets DF on the shared socket, makes room for datagrams of up
+    // to "linkMtu" and starts path mtu discovery in every session, present and future,
+    // see UDPSession::SetPathMTUDiscovery. Pass 0 to stop.
+    int SetPathMTUDiscovery(size_t linkMtu) noexcept;
+
+    // SetBusyPoll sets SO_BUSY_POLL and SO_PREFER_BUSY_POLL on the shared socket and
+    // switches every session, present and future, to flushing on Write, see
+    // UDPSession::SetBusyPoll.
+    int SetBusyPoll(int usecs) noexcept;
+
+    // GetStats returns a snapshot of the listener counters.
+    ListenerStats GetStats() const noexcept;
+
+    // SetStatsExporter publishes the listener counters into "exp" on every Update.
+    int SetStatsExporter(StatsExporter *exp) noexcept;
+
+private:
+    UDPListener() = default;
+
+    ~UDPListener() = default;
+
+    static UDPListener *listen(const char *ip, uint16_t port, bool reuseport);
+
+    static UDPListener *createListener(int sockfd);
+
+    // setTransport replaces the transport with "io", which may be nullptr if creating it failed.
+    int setTransport(Transport *io) noexcept;
+
+    // receive reads and dispatches all pending datagrams, sessions which got
+    // input are appended once to "touched" if it is not nullptr.
+    void receive(std::vector<UDPSession *> *touched, uint32_t current) noexcept;
+
+    // flush sends the shared output batch and publishes stats.
+    void flush(uint32_t current) noexcept;
+
+    // dispatch finds (or creates) the session for one datagram and feeds it,
+    // see UDPSession::input for "current" and "delay".
+    UDPSession *dispatch(const Datagram &d, uint32_t current, uint32_t delay) noexcept;
+
+    // remove forgets a session which is being destroyed.
+    void remove(UDPSession *sess) noexcept;
+
+    static sessionKey makeKey(const struct sockaddr *addr, uint32_t conv) noexcept;
+
+    // sessionOf returns the key of a session in m_sessions, see m_byConv.
+    sessionKey sessionOf(const struct sockaddr *addr, uint32_t conv) const noexcept;
+
+    // migrate moves "sess" to the remote address "addr" after a datagram came from it.
+    void migrate(UDPSession *sess, const struct sockaddr *addr, socklen_t addrlen) noexcept;
+
+    friend class UDPSession;
+
+    friend class EventLoop;
+};
+
+#endif //KCP_LISTENER_H
@@ -0,0 +1,150 @@
+#include "pmtu.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+void
+PathMTU::Start(size_t cur, size_t min, size_t max, uint32_t now) noexcept {
+    if (max < min) {
+        max = min;
+    }
+    m_cur = cur < min ? min : cur > max ? max : cur;
+    m_min = min;
+    m_max = max;
+    m_lo = 0;
+    m_hi = 0;
+    m_cand = m_cur;
+    m_attempts = 0;
+    m_due = now;
+    m_state = stateVerify;
+}
+
+void
+PathMTU::Stop() noexcept {
+    m_state = stateOff;
+    m_lo = 0;
+}
+
+size_t
+PathMTU::Next(uint32_t now, uint32_t timeout, uint32_t *seq) noexcept {
+    if (m_state == stateOff || int32_t(now - m_due) < 0) {
+        return 0;
+    }
+    if (m_state == stateIdle) {
+        Start(m_lo, m_min, m_max, now);
+    } else if (m_attempts >= pmtuAttempts) {
+        lost(now);
+        if (m_state == stateOff || m_state == stateIdle) {
+            return 0;
+        }
+    }
+
+    m_attempts++;
+    m_seq++;
+    m_due = now + timeout;
+    *seq = m_seq;
+    return m_cand;
+}
+
+void
+PathMTU::Ack(uint32_t seq, uint32_t now) noexcept {
+    if (m_attempts == 0 || seq != m_seq) {
+        return;     // late answer to an earlier probe
+    }
+
+    switch (m_state) {
+        case stateVerify:
+            m_lo = m_cand;
+            m_hi = m_max;
+            break;
+        case stateFallback:
+            m_lo = m_cand;
+            m_hi = m_cur - 1;
+            break;
+        case stateSearch:
+            m_lo = m_cand;
+            break;
+        default:
+            return;
+    }
+    next(now);
+}
+
+void
+PathMTU::lost(uint32_t now) noexcept {
+    switch (m_state) {
+        case stateVerify:
+            if (m_cur <= m_min) {
+                Stop();
+                return;
+            }
+            m_state = stateFallback;
+            m_cand = m_min;
+            m_attempts = 0;
+            break;
+        case stateFallback:
+            Stop();     // not even the minimum gets an answer
+            break;
+        case stateSearch:
+            m_hi = m_cand - 1;
+            next(now);
+            break;
+        default:
+            break;
+    }
+}
+
+void
+PathMTU::next(uint32_t now) noexcept {
+    m_attempts = 0;
+    if (m_hi < m_lo + pmtuStep) {
+        m_state = stateIdle;
+        m_due = now + pmtuRaiseInterval;
+        return;
+    }
+    m_cand = (m_lo + m_hi + 1) / 2;
+    m_state = stateSearch;
+    m_due = now;
+}
+
+int
+pmtuSetDF(int sockfd) noexcept {
+    int ret = -1;
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    int val = IP_PMTUDISC_PROBE;
+    ret = setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#endif
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+    if (pmtuOverhead(sockfd) == 48) {
+        int val6 = IPV6_PMTUDISC_PROBE;
+        ret = setsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val6, sizeof(val6));
+    }
+#endif
+    (void) sockfd;
+    return ret;
+}
+
+size_t
+pmtuOverhead(int sockfd) noexcept {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr *) &addr, &len) == 0 && addr.ss_family == AF_INET6) {
+        return 40 + 8;
+    }
+    return 20 + 8;
+}
+
+size_t
+pmtuKernel(int sockfd) noexcept {
+#ifdef IP_MTU
+    size_t overhead = pmtuOverhead(sockfd);
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    int ret = overhead == 48 ? getsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len)
+                             : getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &len);
+    if (ret == 0 && size_t(mtu) > overhead) {
+        return size_t(mtu) - overhead;
+    }
+#endif
+    (void) sockfd;
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef KCP_PMTU_H
+#define KCP_PMTU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Probe datagrams bypass FEC and kcp:
+//
+//   [conv 4B] [probeMark 1B] [kind 1B] [size 2B] [seq 4B] [zero padding up to size]
+//
+// Byte 4 holds the kcp cmd (0x51-0x54) in plain packets and the low byte of the FEC
+// flag (0xf1, 0xf2) in FEC packets, so probeMark is told apart in both modes. "size"
+// is the probed udp payload size, a request is padded to it, an ack is not.
+const uint8_t probeMark = 0xf3;
+const uint8_t probeRequest = 1;
+const uint8_t probeAck = 2;
+const size_t probeHeaderSize = 12;
+
+const size_t pmtuMinIPv4 = 548;     // udp payload of a 576 byte ipv4 packet
+const size_t pmtuMinIPv6 = 1232;    // udp payload of a 1280 byte ipv6 packet
+const size_t pmtuStep = 16;         // the search stops once its bounds are this close
+const int pmtuAttempts = 3;         // unanswered probes before a size counts as too large
+const uint32_t pmtuRaiseInterval = 600000;  // ms between searches, the path may change
+
+// PathMTU searches the largest udp payload which reaches the peer (packetization
+// layer PMTUD, RFC 8899 style). Only one probe is in flight at a time.
+//
+// The current size is verified first. If it gets through, the range up to the maximum
+// is bisected. If it is lost, the minimum is tried and the range below the current size
+// bisected. If the minimum is lost as well, the peer doesn't answer probes and the
+// search ends without a result. Every pmtuRaiseInterval the search starts over from
+// the size found, so both growing and shrinking paths are followed.
+class PathMTU {
+public:
+    // Start begins a search from "cur" within [min, max], the first probe is due at "now".
+    void Start(size_t cur, size_t min, size_t max, uint32_t now) noexcept;
+
+    void Stop() noexcept;
+
+    inline bool Active() const noexcept { return m_state != stateOff; }
+
+    // Next returns the size of the probe to send at "now" and its sequence number,
+    // 0 if none is due. A probe unanswered for "timeout" ms counts as lost.
+    size_t Next(uint32_t now, uint32_t timeout, uint32_t *seq) noexcept;
+
+    // Ack records the answer to probe "seq".
+    void Ack(uint32_t seq, uint32_t now) noexcept;
+
+    // Deadline returns the time at which Next has something to do.
+    inline uint32_t Deadline() const noexcept { return m_due; }
+
+    // Size returns the largest payload confirmed so far, 0 if none.
+    inline size_t Size() const noexcept { return m_lo; }
+
+private:
+    enum state {
+        stateOff,
+        stateVerify,    // probing the current size
+        stateFallback,  // probing the minimum after the current size was lost
+        stateSearch,    // bisecting [m_lo, m_hi]
+        stateIdle,      // done until the next raise
+    };
+
+    // next picks the following candidate, or goes idle once the bounds have met.
+    void next(uint32_t now) noexcept;
+
+    void lost(uint32_t now) noexcept;
+
+    state m_state{stateOff};
+    size_t m_cur{0};
+    size_t m_min{0};
+    size_t m_max{0};
+    size_t m_lo{0};
+    size_t m_hi{0};
+    size_t m_cand{0};
+    uint32_t m_seq{0};
+    int m_attempts{0};  // probes sent for m_cand
+    uint32_t m_due{0};
+};
+
+// pmtuSetDF makes the kernel send every datagram of "sockfd" with DF set, without
+// limiting them to its own path mtu estimate, so that probes larger than it go out.
+int pmtuSetDF(int sockfd) noexcept;
+
+// pmtuOverhead returns the ip and udp header bytes in front of a payload on "sockfd".
+size_t pmtuOverhead(int sockfd) noexcept;
+
+// pmtuKernel returns the udp payload the kernel expects to fit on the route of a
+// connected "sockfd" (IP_MTU), 0 if unknown.
+size_t pmtuKernel(int sockfd) noexcept;
+
+#endif //KCP_PMTU_H
@@ -0,0 +1,136 @@
+#ifndef KCP_QUEUE_H
+#define KCP_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+const size_t cacheLineSize = 64;
+
+// roundPow2 returns the smallest power of two >= n, at least 2.
+inline size_t roundPow2(size_t n) {
+    size_t p = 2;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// MPSCQueue is a bounded lock-free queue for many producers and one consumer
+// (Vyukov's bounded queue). Every cell carries a sequence number telling whether
+// it is free for the producer at position "pos" (seq == pos) or holds the value
+// for the consumer (seq == pos + 1). Producers only contend on one counter.
+template<typename T>
+class MPSCQueue {
+public:
+    explicit MPSCQueue(size_t capacity) : m_mask(roundPow2(capacity) - 1), m_cells(new cell[m_mask + 1]) {
+        for (size_t i = 0; i <= m_mask; i++) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPSCQueue(const MPSCQueue &) = delete;
+
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+    // Push may be called from any thread, returns false if the queue is full.
+    bool Push(const T &v) noexcept {
+        size_t pos = m_enqueue.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;) {
+            c = &m_cells[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = intptr_t(seq) - intptr_t(pos);
+            if (dif == 0) {
+                if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+        c->value = v;
+        c->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pop must only be called from the consumer thread, returns false if the queue is empty.
+    bool Pop(T *v) noexcept {
+        cell *c = &m_cells[m_dequeue & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        if (intptr_t(seq) - intptr_t(m_dequeue + 1) < 0) {
+            return false;
+        }
+        *v = c->value;
+        c->seq.store(m_dequeue + m_mask + 1, std::memory_order_release);
+        m_dequeue++;
+        return true;
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    const size_t m_mask;
+    std::unique_ptr<cell[]> m_cells;
+    char m_pad0[cacheLineSize];
+    std::atomic<size_t> m_enqueue{0};
+    char m_pad1[cacheLineSize];
+    size_t m_dequeue{0};
+};
+
+// SPSCQueue is a bounded lock-free ring for one producer and one consumer thread.
+template<typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) : m_mask(roundPow2(capacity) - 1), m_values(new T[m_mask + 1]) {}
+
+    SPSCQueue(const SPSCQueue &) = delete;
+
+    SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+    // Push is called by the producer, returns false if the queue is full.
+    bool Push(const T &v) noexcept {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask) {
+            return false;
+        }
+        m_values[tail & m_mask] = v;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Full is called by the producer.
+    bool Full() const noexcept {
+        return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire) > m_mask;
+    }
+
+    // Front is called by the consumer, it returns the oldest value without removing it.
+    T *Front() noexcept {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &m_values[head & m_mask];
+    }
+
+    // Pop is called by the consumer and removes the value returned by Front.
+    void Pop() noexcept {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    const size_t m_mask;
+    std::unique_ptr<T[]> m_values;
+    char m_pad0[cacheLineSize];
+    std::atomic<size_t> m_head{0};
+    char m_pad1[cacheLineSize];
+    std::atomic<size_t> m_tail{0};
+};
+
+#endif //KCP_QUEUE_H
@@ -0,0 +1,239 @@
+//
+// rs_bench measures the Reed-Solomon codec: galMulSlice/galMulSliceXor, Encode and
+// Reconstruct throughput over a grid of shard sizes, data/parity counts and erasure
+// patterns, and the cost of an inversion tree miss (building and inverting the decode
+// matrix) apart from a hit. Throughput counts data bytes, i.e. dataShards * shard size
+// per Encode or Reconstruct. Prints one JSON object (or CSV row) per measurement.
+//
+//   rs_bench -size 64,1024,65536 -shards 10:3,20:10 -time 0.2
+//
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <time.h>
+#include "reedsolomon.h"
+#include "galois_noasm.h"
+
+// erasure patterns for Reconstruct
+const char *const patterns[] = {
+        "data1",    // the first data shard
+        "datamax",  // as many data shards as there are parity shards
+        "parity1",  // the first parity shard, which is encoded again
+        "mixed",    // half of the losses on data shards, half on parity shards
+};
+
+static uint64_t
+monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+// erased returns the shards lost in "pattern"
+static std::vector<int>
+erased(const std::string &pattern, int dataShards, int parityShards) {
+    std::vector<int> out;
+    if (pattern == "data1") {
+        out.push_back(0);
+    } else if (pattern == "datamax") {
+        for (int i = 0; i < parityShards && i < dataShards; i++) {
+            out.push_back(i);
+        }
+    } else if (pattern == "parity1") {
+        out.push_back(dataShards);
+    } else {
+        int half = parityShards / 2 > 0 ? parityShards / 2 : 1;
+        for (int i = 0; i < half && i < dataShards; i++) {
+            out.push_back(i);
+        }
+        for (int i = 0; i < parityShards - half; i++) {
+            out.push_back(dataShards + i);
+        }
+    }
+    return out;
+}
+
+static std::vector<row_type>
+newShards(int total, size_t size) {
+    std::vector<row_type> shards(total);
+    for (int i = 0; i < total; i++) {
+        shards[i] = std::make_shared<std::vector<byte>>(size);
+        for (size_t j = 0; j < size; j++) {
+            (*shards[i])[j] = byte(rand());
+        }
+    }
+    return shards;
+}
+
+// timeLoop runs "fn" until "minTime" seconds passed, returns ns per call
+template<typename F>
+static double
+timeLoop(double minTime, F fn) {
+    fn();   // warm up, and fill the inversion tree
+    uint64_t iters = 0;
+    uint64_t start = monotonicNs();
+    uint64_t limit = start + uint64_t(minTime * 1e9);
+    uint64_t now;
+    do {
+        for (int i = 0; i < 16; i++) {
+            fn();
+        }
+        iters += 16;
+        now = monotonicNs();
+    } while (now < limit);
+    return double(now - start) / double(iters);
+}
+
+static bool g_csv = false;
+static bool g_first = true;
+
+static void
+report(const char *op, int dataShards, int parityShards, size_t size, const char *pattern, double ns,
+       size_t bytes) {
+    double gbs = bytes > 0 ? double(bytes) / ns : 0;   // bytes per ns is GB/s
+    if (g_csv) {
+        printf("%s,%d,%d,%zu,%s,%.1f,%.3f\n", op, dataShards, parityShards, size, pattern, ns, gbs);
+    } else {
+        printf("%s  {\"op\": \"%s\", \"data_shards\": %d, \"parity_shards\": %d, \"shard_size\": %zu, "
+               "\"pattern\": \"%s\", \"ns_per_op\": %.1f, \"gbps\": %.3f}",
+               g_first ? "" : ",\n", op, dataShards, parityShards, size, pattern, ns, gbs);
+    }
+    fflush(stdout);
+    g_first = false;
+}
+
+static std::vector<std::string>
+split(const char *s) {
+    std::vector<std::string> out;
+    std::string cur;
+    for (; *s; s++) {
+        if (*s == ',') {
+            out.push_back(cur);
+            cur.clear();
+        } else {
+            cur += *s;
+        }
+    }
+    out.push_back(cur);
+    return out;
+}
+
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes{64, 256, 1024, 4096, 16384, 65536};
+    std::vector<std::pair<int, int>> grid{{4, 2}, {10, 3}, {20, 10}};
+    std::vector<std::string> pats(std::begin(patterns), std::end(patterns));
+    double minTime = 0.2;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *k = argv[i], *v = argv[i + 1];
+        if (!strcmp(k, "-size")) {
+            sizes.clear();
+            for (auto &s : split(v)) sizes.push_back(strtoul(s.c_str(), nullptr, 10));
+        } else if (!strcmp(k, "-shards")) {
+            grid.clear();
+            for (auto &s : split(v)) {
+                int d = 0, p = 0;
+                sscanf(s.c_str(), "%d:%d", &d, &p);
+                grid.emplace_back(d, p);
+            }
+        } else if (!strcmp(k, "-pattern")) pats = split(v);
+        else if (!strcmp(k, "-time")) minTime = atof(v);
+        else if (!strcmp(k, "-format")) g_csv = !strcmp(v, "csv");
+        else {
+            fprintf(stderr, "usage: %s [-size bytes,...] [-shards data:parity,...] "
+                            "[-pattern data1,datamax,parity1,mixed] [-time s] [-format json|csv]\n", argv[0]);
+            return 2;
+        }
+    }
+    srand(1);
+
+    if (g_csv) {
+        printf("op,data_shards,parity_shards,shard_size,pattern,ns_per_op,gbps\n");
+    } else {
+        printf("[\n");
+    }
+
+    // the inner loop of the codec, one coefficient times one shard
+    for (size_t size : sizes) {
+        auto in = newShards(2, size);
+        row_type out = in[1];
+        double ns = timeLoop(minTime, [&] { galMulSlice(0x8e, in[0], out); });
+        report("galMulSlice", 0, 0, size, "", ns, size);
+        ns = timeLoop(minTime, [&] { galMulSliceXor(0x8e, in[0], out); });
+        report("galMulSliceXor", 0, 0, size, "", ns, size);
+    }
+
+    for (auto &g : grid) {
+        int d = g.first, p = g.second;
+        ReedSolomon rs = ReedSolomon::New(d, p);
+
+        for (size_t size : sizes) {
+            auto shards = newShards(d + p, size);
+            size_t bytes = size_t(d) * size;
+            double ns = timeLoop(minTime, [&] { rs.Encode(shards); });
+            report("encode", d, p, size, "", ns, bytes);
+
+            // the inversion tree is warm after the first call, this is the steady state
+            for (auto &pat : pats) {
+                auto lost = erased(pat, d, p);
+                std::vector<row_type> work(shards);
+                ns = timeLoop(minTime, [&] {
+                    for (int i : lost) {
+                        work[i] = nullptr;
+                    }
+                    rs.Reconstruct(work);
+                });
+                report("reconstruct", d, p, size, pat.c_str(), ns, bytes);
+            }
+        }
+
+        // an inversion tree miss: the decode matrix is built from the surviving rows of
+        // the encoding matrix and inverted, as Reconstruct does before inserting it
+        matrix vm = matrix::vandermonde(d + p, d);
+        matrix top = vm.SubMatrix(0, 0, d, d).Invert();
+        matrix m = vm.Multiply(top);
+        for (auto &pat : pats) {
+            auto lost = erased(pat, d, p);
+            std::vector<int> valid;
+            for (int r = 0; r < d + p && int(valid.size()) < d; r++) {
+                if (std::find(lost.begin(), lost.end(), r) == lost.end()) {
+                    valid.push_back(r);
+                }
+            }
+            double ns = timeLoop(minTime, [&] {
+                matrix sub = matrix::newMatrix(d, d);
+                for (int r = 0; r < d; r++) {
+                    for (int c = 0; c < d; c++) {
+                        sub.at(r, c) = m.at(valid[size_t(r)], c);
+                    }
+                }
+                sub.Invert();
+            });
+            report("invert_miss", d, p, 0, pat.c_str(), ns, 0);
+
+            // a hit is a walk down the tree
+            std::vector<int> invalid;
+            for (int r = 0; r < d + p && int(invalid.size()) < int(lost.size()); r++) {
+                if (std::find(lost.begin(), lost.end(), r) != lost.end() && r < valid.back()) {
+                    invalid.push_back(r);
+                }
+            }
+            inversionTree tree = inversionTree::newInversionTree(d, p);
+            matrix inv = matrix::identityMatrix(d);
+            if (!invalid.empty()) {
+                tree.InsertInvertedMatrix(invalid, inv, d + p);
+            }
+            ns = timeLoop(minTime, [&] { tree.GetInvertedMatrix(invalid); });
+            report("invert_hit", d, p, 0, pat.c_str(), ns, 0);
+        }
+    }
+
+    if (!g_csv) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -1,6 +1,11 @@
 #include "sess.h"
+#include "listener.h"
+#include "eventloop.h"
+#include "uring.h"
+#include "xdp.h"
 #include "encoding.h"
 #include <iostream>
+#include <cstring>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <arpa/inet.h>
@@ -49,6 +54,30 @@ UDPSession::DialWithOptions(const char *ip, uint16_t port, size_t dataShards, si
     return sess;
 };
 
+UDPSession *
+UDPSession::DialTransport(Transport *io, uint32_t conv, size_t dataShards, size_t parityShards) {
+    if (io == nullptr) {
+        return nullptr;
+    }
+
+    UDPSession *sess = new(UDPSession);
+    sess->m_sockfd = -1;
+    sess->m_io = io;
+    sess->m_io->SetTimestamps(true);
+    sess->m_buf.resize(sessBufSize);
+    sess->m_kcp = ikcp_create(conv, sess);
+    sess->m_kcp->output = sess->out_wrapper;
+    sess->m_kcpBuf = int(sess->m_kcp->mtu);
+
+    if (dataShards > 0 && parityShards > 0) {
+        sess->fec = FEC::New(3 * (dataShards + parityShards), dataShards, parityShards);
+        sess->shards.resize(dataShards + parityShards, nullptr);
+        sess->dataShards = dataShards;
+        sess->parityShards = parityShards;
+    }
+    return sess;
+}
+
 
 UDPSession *
 UDPSession::dialIPv6(const char *ip, uint16_t port) {
@@ -85,8 +114,37 @@ UDPSession::createSession(int sockfd) {
 
     UDPSession *sess = new(UDPSession);
     sess->m_sockfd = sockfd;
+    sess->m_io = new SocketTransport(sockfd);
+    sess->m_io->SetTimestamps(true);
+    sess->m_buf.resize(sessBufSize);
     sess->m_kcp = ikcp_create(IUINT32(rand()), sess);
     sess->m_kcp->output = sess->out_wrapper;
+    sess->m_kcpBuf = int(sess->m_kcp->mtu);
+    return sess;
+}
+
+UDPSession *
+UDPSession::acceptSession(UDPListener *l, const struct sockaddr *addr, socklen_t addrlen, uint32_t conv) {
+    UDPSession *sess = new(UDPSession);
+    sess->m_sockfd = -1;
+    sess->m_listener = l;
+    memcpy(&sess->m_raddr, addr, addrlen);
+    sess->m_raddrlen = addrlen;
+    sess->m_buf.resize(sessBufSize);
+    sess->m_kcp = ikcp_create(conv, sess);
+    sess->m_kcp->output = sess->out_wrapper;
+    sess->m_kcpBuf = int(sess->m_kcp->mtu);
+    sess->m_busyPoll = l->m_busyPoll;
+
+    if (l->dataShards > 0 && l->parityShards > 0) {
+        sess->fec = FEC::New(3 * (l->dataShards + l->parityShards), l->dataShards, l->parityShards);
+        sess->shards.resize(l->dataShards + l->parityShards, nullptr);
+        sess->dataShards = l->dataShards;
+        sess->parityShards = l->parityShards;
+    }
+    if (l->m_pmtuLink > 0) {
+        sess->SetPathMTUDiscovery(l->m_pmtuLink);
+    }
     return sess;
 }
 
@@ -99,59 +157,159 @@ UDPSession::createSession(int sockfd) {
  */
 void
 UDPSession::Update(uint32_t current) noexcept {
-    for (;;) {
-        // m_buf : [seqid] [flag] [[sz] [actual data]]
-        ssize_t n = recv(m_sockfd, m_buf, sizeof(m_buf), 0);
-        if (n > 0) {
-            if (fec.isEnabled()) {
-                // pkt: [seqid] [flag] [[sz] [actual data]] [ts]
-                auto pkt = fec.Decode(m_buf, static_cast<size_t>(n));
-                if (pkt.flag == typeData) {         // pkt.data: shared_ptr<std::vector<bytes>>
-                    auto ptr = pkt.data->data();    // pointer to the underlying element storage
-                    // we have 2B size, ignore for typeData
-                    ikcp_input(m_kcp, (char *) (ptr + 2), pkt.data->size() - 2);
-                }
+    // sessions accepted by a listener are fed by UDPListener::Update
+    if (m_listener == nullptr) {
+        for (;;) {
+            // the whole batch goes through FEC and kcp input before a single flush
+            Datagram *dgrams;
+            bool more;
+            int n = m_io->Recv(&dgrams, &more);
+            if (m_aead != nullptr && n > 0) {
+                int opened = m_aead->OpenBatch(dgrams, n);
+                m_stats.cryptErrs += uint64_t(n - opened);
+                n = opened;
+            }
+            uint64_t now = n > 0 ? realtimeNs() : 0;
+            for (int i = 0; i < n; i++) {
+                // m_buf : [seqid] [flag] [[sz] [actual data]]
+                input(dgrams[i].data, dgrams[i].len, current, queueDelay(dgrams[i], now));
+            }
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    if (m_pmtu.Active()) {
+        uint32_t seq;
+        size_t size = m_pmtu.Next(current, m_kcp->rx_rto, &seq);
+        if (size > 0) {
+            probe(probeRequest, size, seq, size);
+        }
+    }
+    if (m_pmtuBase > 0 && !m_pmtu.Active()) {
+        if (m_pmtuSize == 0) {
+            setKcpMtu(int(m_pmtuBase - overhead()));    // the peer doesn't answer probes
+        }
+        m_pmtuBase = 0;
+    }
+
+    m_kcp->current = current;
+
+    ikcp_flush(m_kcp);  // ikcp_flush output_wrapper
+
+    // Update always flushes, record the next interval tick so that ikcp_check can schedule us
+    m_kcp->updated = 1;
+    m_kcp->ts_flush = current + m_kcp->interval;
+
+    // the listener flushes its shared batch once all of its sessions are updated
+    if (m_listener == nullptr) {
+        m_io->Flush();
+    }
+
+    if (m_exporter != nullptr) {
+        auto stats = GetStats();
+        m_exporter->Publish(m_statsSlot, &stats, sizeof(stats), current);
+    }
+}
+
+void
+UDPSession::input(byte *data, size_t n, uint32_t current, uint32_t delay) noexcept {
+    m_stats.inPkts++;
+    m_stats.inBytes += n;
+
+    // ikcp_input samples rtt as kcp->current minus the echoed send time
+    m_kcp->current = current - delay / 1000;
+    if (delay != 0) {
+        // smoothed like srtt, gain 1/8
+        m_stats.rxDelay = uint32_t(int64_t(m_stats.rxDelay) + (int64_t(delay) - int64_t(m_stats.rxDelay)) / 8);
+        if (delay > m_stats.rxDelayMax) {
+            m_stats.rxDelayMax = delay;
+        }
+    }
+
+    // probes bypass FEC and kcp, byte 4 tells them apart in both modes
+    if (n >= probeHeaderSize && data[4] == probeMark) {
+        onProbe(data, n, current);
+        return;
+    }
+    if (fec.isEnabled()) {
+        if (n < fecHeaderSizePlus2) {
+            return;
+        }
+
+        // pkt: [seqid] [flag] [[sz] [actual data]] [ts]
+        auto pkt = fec.Decode(data, n);
+        if (pkt.flag == typeData) {         // pkt.data: shared_ptr<std::vector<bytes>>
+            auto ptr = pkt.data->data();    // pointer to the underlying element storage
+            // we have 2B size, ignore for typeData
+            ikcp_input(m_kcp, (char *) (ptr + 2), pkt.data->size() - 2);
+        }
 
-                // allow FEC packet processing with correct flags.
-                if (pkt.flag == typeData || pkt.flag == typeFEC) {
-                    // input to FEC, and see if we can recover data.
-                    auto recovered = fec.Input(pkt);
-
-                    // we have some data recovered.
-                    for (auto &r : recovered) {
-                        // recovered data has at least 2B size.
-                        if (r->size() > 2) {
-                            auto ptr = r->data();
-                            // decode packet size, which is also recovered.
-                            uint16_t sz;
-                            decode16u(ptr, &sz);
-
-                            // the recovered packet size must be in the correct range.
-                            if (sz >= 2 && sz <= r->size()) {
-                                // input proper data to kcp
-                                ikcp_input(m_kcp, (char *) (ptr + 2), sz - 2);
-                                // std::cout << "sz:" << sz << std::endl;
-                            }
-                        }
+        // allow FEC packet processing with correct flags.
+        if (pkt.flag == typeData || pkt.flag == typeFEC) {
+            // input to FEC, and see if we can recover data.
+            auto recovered = fec.Input(pkt, current);
+            m_stats.fecRecovered += recovered.size();
+
+            // we have some data recovered.
+            for (auto &r : recovered) {
+                // recovered data has at least 2B size.
+                if (r->size() > 2) {
+                    auto ptr = r->data();
+                    // decode packet size, which is also recovered.
+                    uint16_t sz;
+                    decode16u(ptr, &sz);
+
+                    // the recovered packet size must be in the correct range.
+                    if (sz >= 2 && sz <= r->size()) {
+                        // input proper data to kcp
+                        ikcp_input(m_kcp, (char *) (ptr + 2), sz - 2);
+                        // std::cout << "sz:" << sz << std::endl;
+                    } else {
+                        m_stats.fecErrs++;
                     }
                 }
-            } else { // fec disabled
-                ikcp_input(m_kcp, (char *) (m_buf), n);
             }
-        } else {
-            break;
         }
+    } else { // fec disabled
+        ikcp_input(m_kcp, (char *) (data), n);
     }
+}
 
-    m_kcp->current = current;
+bool
+UDPSession::Idle() const noexcept {
+    // rmt_wnd 0 is probed for, a pending mtu restore happens in Update
+    return ikcp_waitsnd(m_kcp) == 0 && m_kcp->ackcount == 0 && m_kcp->probe == 0 && m_kcp->rmt_wnd > 0 &&
+           !m_pmtu.Active() && m_pmtuBase == 0;
+}
 
-    ikcp_flush(m_kcp);  // ikcp_flush output_wrapper
+uint32_t
+UDPSession::Check(uint32_t current) noexcept {
+    if (Idle()) {
+        return current + checkIdle;
+    }
+    uint32_t due = ikcp_check(m_kcp, current);
+    if (m_pmtu.Active() && int32_t(m_pmtu.Deadline() - due) < 0) {
+        due = m_pmtu.Deadline();
+    }
+    return due;
 }
 
 void
 UDPSession::Destroy(UDPSession *sess) {
     if (nullptr == sess) return;
-    if (0 != sess->m_sockfd) { close(sess->m_sockfd); }
+    if (nullptr != sess->m_loop) {
+        sess->m_loop->dropWaiters(sess);
+        sess->m_loop->Remove(sess);
+    }
+    dropWaiter(sess->m_readWaiter);
+    dropWaiter(sess->m_writeWaiter);
+    if (nullptr != sess->m_exporter) { sess->m_exporter->Release(sess->m_statsSlot); }
+    if (nullptr != sess->m_listener) { sess->m_listener->remove(sess); }
+    delete sess->m_io;
+    AEAD::Destroy(sess->m_aead);
+    if (0 < sess->m_sockfd) { close(sess->m_sockfd); }
     if (nullptr != sess->m_kcp) { ikcp_release(sess->m_kcp); }
     delete sess;
 }
@@ -163,34 +321,137 @@ UDPSession::Destroy(UDPSession *sess) {
  */
 ssize_t
 UDPSession::Read(char *buf, size_t sz) noexcept {
-    if (m_streambufsiz > 0) {
-        size_t n = m_streambufsiz;
+    if (m_streamoff < m_streambuf.size()) {
+        size_t n = m_streambuf.size() - m_streamoff;
         if (n > sz) {
             n = sz;
         }
-        memcpy(buf, m_streambuf, n);
+        memcpy(buf, m_streambuf.data() + m_streamoff, n);
+        m_streamoff += n;
+        return n;
+    }
 
-        m_streambufsiz -= n;
-        if (m_streambufsiz != 0) {
-            memmove(m_streambuf, m_streambuf + n, m_streambufsiz);
-        }
+    int psz = ikcp_peeksize(m_kcp);
+    if (psz <= 0) {
+        return 0;
+    }
+
+    if (!m_stamps && size_t(psz) <= sz) {
+        int n = ikcp_recv(m_kcp, buf, int(sz));
+        received();
         return n;
     }
 
+    // keep the remainder, later Reads consume it by moving the offset
+    recvMessage();
+    size_t n = m_streambuf.size() - m_streamoff;
+    if (n > sz) {
+        n = sz;
+    }
+    memcpy(buf, m_streambuf.data() + m_streamoff, n);
+    m_streamoff += n;
+    return n;
+}
+
+bool
+UDPSession::Writable() const noexcept {
+    return ikcp_waitsnd(m_kcp) < int(m_kcp->snd_wnd);
+}
+
+size_t
+UDPSession::MaxMessage() const noexcept {
+    size_t max = kcpMaxFragments * size_t(m_kcp->mss);
+    return m_stamps ? max - latencyStampSize : max;
+}
+
+void
+UDPSession::AwaitReadable(Waiter w) noexcept {
+    m_readWaiter = w;
+}
+
+void
+UDPSession::AwaitWritable(Waiter w) noexcept {
+    m_writeWaiter = w;
+}
+
+size_t
+UDPSession::PeekSize() const noexcept {
+    if (m_streamoff < m_streambuf.size()) {
+        return m_streambuf.size() - m_streamoff;
+    }
+    int psz = ikcp_peeksize(m_kcp);
+    if (m_stamps) {
+        psz -= int(latencyStampSize);
+    }
+    return psz > 0 ? size_t(psz) : 0;
+}
+
+ssize_t
+UDPSession::Readv(const struct iovec *iov, int iovcnt) noexcept {
+    size_t total = 0;
+    int i = 0;
+    size_t off = 0;     // bytes filled in iov[i]
+
+    for (;;) {
+        // the pending message, or the next one
+        if (m_streamoff == m_streambuf.size()) {
+            if (total > 0 && !m_kcp->stream) {
+                break;
+            }
+            if (recvMessage() == 0) {
+                break;
+            }
+        }
+
+        while (i < iovcnt && m_streamoff < m_streambuf.size()) {
+            size_t n = iov[i].iov_len - off;
+            if (n > m_streambuf.size() - m_streamoff) {
+                n = m_streambuf.size() - m_streamoff;
+            }
+            memcpy(static_cast<char *>(iov[i].iov_base) + off, m_streambuf.data() + m_streamoff, n);
+            m_streamoff += n;
+            off += n;
+            total += n;
+            if (off == iov[i].iov_len) {
+                i++;
+                off = 0;
+            }
+        }
+        if (i == iovcnt) {
+            break;
+        }
+    }
+    return ssize_t(total);
+}
+
+void
+UDPSession::received() noexcept {
+    // ikcp_recv asks for a window update once the receive queue drains below rcv_wnd,
+    // the session may be idle and without a deadline in the event loop
+    if (m_kcp->probe != 0 && m_loop != nullptr) {
+        m_loop->Notify(this);
+    }
+}
+
+size_t
+UDPSession::recvMessage() noexcept {
     int psz = ikcp_peeksize(m_kcp);
     if (psz <= 0) {
         return 0;
     }
 
-    if (psz <= sz) {
-        return (ssize_t) ikcp_recv(m_kcp, buf, int(sz));
-    } else {
-        ikcp_recv(m_kcp, (char *) m_streambuf, sizeof(m_streambuf));
-        memcpy(buf, m_streambuf, sz);
-        m_streambufsiz = psz - sz;
-        memmove(m_streambuf, m_streambuf + sz, psz - sz);
-        return sz;
+    m_streambuf.resize(size_t(psz));
+    ikcp_recv(m_kcp, m_streambuf.data(), psz);
+    received();
+    m_streamoff = 0;
+    if (m_stamps && size_t(psz) >= latencyStampSize) {
+        uint32_t sent;
+        decode32u(reinterpret_cast<byte *>(m_streambuf.data()), &sent);
+        int32_t lat = int32_t(uint32_t(clockNow() / 1000) - sent);
+        m_latency.Record(lat > 0 ? uint32_t(lat) : 0);
+        m_streamoff = latencyStampSize;
     }
+    return size_t(psz);
 }
 
 /*
@@ -198,27 +459,360 @@ UDPSession::Read(char *buf, size_t sz) noexcept {
  */
 ssize_t
 UDPSession::Write(const char *buf, size_t sz) noexcept {
-    int n = ikcp_send(m_kcp, const_cast<char *>(buf), int(sz));
+    int n;
+    if (m_stamps) {
+        m_sendbuf.resize(latencyStampSize + sz);
+        encode32u(reinterpret_cast<byte *>(m_sendbuf.data()), uint32_t(clockNow() / 1000));
+        memcpy(m_sendbuf.data() + latencyStampSize, buf, sz);
+        n = ikcp_send(m_kcp, m_sendbuf.data(), int(m_sendbuf.size()));
+    } else {
+        n = ikcp_send(m_kcp, const_cast<char *>(buf), int(sz));
+    }
+    if (m_busyPoll) {
+        flush(currentMs());
+    } else if (m_loop != nullptr) {
+        m_loop->Notify(this);   // flush on the next loop round rather than the next tick
+    }
     if (n == 0) {
         return sz;
     } else return n;
 }
 
+void
+UDPSession::SetGSO(bool enable) noexcept {
+    if (m_io != nullptr) {
+        m_io->SetGSO(enable);
+    }
+}
+
+void
+UDPSession::SetSockBufMax(size_t max) noexcept {
+    if (m_io != nullptr) {
+        m_io->SetSockBufMax(max);
+    }
+}
+
+int
+UDPSession::SetRxTimestamps(bool enable) noexcept {
+    if (m_io == nullptr) {
+        return -1;  // the socket belongs to the listener
+    }
+    return m_io->SetTimestamps(enable);
+}
+
 int
 UDPSession::SetDSCP(int iptos) noexcept {
+    if (m_listener != nullptr) {
+        return -1;  // the socket belongs to the listener, see UDPListener::SetDSCP
+    }
     iptos = (iptos << 2) & 0xFF;
     return setsockopt(this->m_sockfd, IPPROTO_IP, IP_TOS, &iptos, sizeof(iptos));
 }
 
+int
+UDPSession::SetMtu(int mtu) noexcept {
+    if (mtu < int(kcpHeaderSize) * 2) {
+        return -1;
+    }
+    size_t payload = size_t(mtu) + overhead();
+    if (grow(payload) < payload) {
+        return -1;
+    }
+    return setKcpMtu(mtu);
+}
+
+int
+UDPSession::SetPathMTUDiscovery(size_t linkMtu) noexcept {
+    if (linkMtu == 0) {
+        m_pmtu.Stop();
+        return 0;
+    }
+
+    size_t iphdr = m_raddr.ss_family == AF_INET6 ? 40 + 8 : 20 + 8;
+    if (m_listener == nullptr) {
+        if (pmtuSetDF(m_sockfd) < 0) {
+            return -1;
+        }
+        iphdr = pmtuOverhead(m_sockfd);
+    }
+    size_t min = iphdr > 20 + 8 ? pmtuMinIPv6 : pmtuMinIPv4;
+    if (linkMtu < min + iphdr) {
+        return -1;
+    }
+
+    // no further than the kernel's route mtu (connected sockets only) and the transport
+    size_t max = linkMtu - iphdr;
+    if (m_listener == nullptr) {
+        size_t route = pmtuKernel(m_sockfd);
+        if (route >= min && route < max) {
+            max = route;
+        }
+    }
+    max = grow(max);
+
+    // nothing larger than the minimum is sent until a probe came through
+    size_t cur = size_t(m_kcp->mtu) + overhead();
+    if (m_pmtuBase == 0) {
+        m_pmtuBase = cur;
+    }
+    m_pmtuSize = 0;
+    if (cur > min) {
+        setKcpMtu(int(min - overhead()));
+    }
+    m_pmtu.Start(cur, min, max, m_kcp->current);
+    if (m_loop != nullptr) {
+        m_loop->Notify(this);
+    }
+    return 0;
+}
+
+size_t
+UDPSession::grow(size_t payload) noexcept {
+    if (m_io != nullptr) {
+        payload = m_io->MaxDatagram(payload);
+    } else if (m_listener != nullptr) {
+        payload = m_listener->m_io->MaxDatagram(payload);
+    }
+    // room for the headers of whichever mode is switched on later
+    size_t need = payload + fecHeaderSizePlus2 + cryptOverhead;
+    if (m_buf.size() < need) {
+        m_buf.resize(need);
+    }
+    return payload;
+}
+
+int
+UDPSession::setKcpMtu(int mtu) noexcept {
+    if (mtu > m_kcpBuf) {
+        int ret = ikcp_setmtu(m_kcp, mtu);
+        if (ret == 0) {
+            m_kcpBuf = mtu;
+        }
+        return ret;
+    }
+    m_kcp->mtu = IUINT32(mtu);
+    m_kcp->mss = IUINT32(mtu) - IUINT32(kcpHeaderSize);
+    return 0;
+}
+
+size_t
+UDPSession::overhead() const noexcept {
+    size_t n = aead() != nullptr ? cryptOverhead : 0;
+    if (dataShards > 0 && parityShards > 0) {
+        n += fecHeaderSizePlus2;
+    }
+    return n;
+}
+
+void
+UDPSession::probe(uint8_t kind, size_t size, uint32_t seq, size_t len) noexcept {
+    // "len" is the size on the wire, sealing adds its overhead on top of the plaintext
+    size_t sealed = aead() != nullptr ? cryptOverhead : 0;
+    if (len < probeHeaderSize + sealed || len + headroom() > m_buf.size()) {
+        return;
+    }
+
+    size_t n = len - sealed;
+    byte *p = m_buf.data() + headroom();
+    encode32u(p, m_kcp->conv);
+    p[4] = probeMark;
+    p[5] = kind;
+    encode16u(p + 6, uint16_t(size));
+    encode32u(p + 8, seq);
+    memset(p + probeHeaderSize, 0, n - probeHeaderSize);
+    output(p, n);
+}
+
+void
+UDPSession::onProbe(byte *data, size_t n, uint32_t current) noexcept {
+    uint16_t size;
+    uint32_t seq;
+    decode16u(data + 6, &size);
+    decode32u(data + 8, &seq);
+
+    size_t sealed = aead() != nullptr ? cryptOverhead : 0;
+    if (data[5] == probeRequest) {
+        // a truncated probe proves nothing
+        if (n + sealed == size) {
+            probe(probeAck, size, seq, probeHeaderSize + sealed);
+        }
+        return;
+    }
+    if (data[5] != probeAck) {
+        return;
+    }
+
+    m_pmtu.Ack(seq, current);
+    size_t found = m_pmtu.Size();
+    if (found == 0 || found == m_pmtuSize || found < overhead() + kcpHeaderSize * 2) {
+        return;
+    }
+    if (setKcpMtu(int(found - overhead())) == 0) {
+        m_pmtuSize = found;
+    }
+}
+
+int
+UDPSession::SetBusyPoll(int usecs) noexcept {
+    m_busyPoll = usecs > 0;
+    if (m_listener != nullptr) {
+        return 0;
+    }
+
+    int prefer = usecs > 0 ? 1 : 0;
+    if (setsockopt(m_sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    return setsockopt(m_sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#else
+    (void) prefer;
+    return 0;
+#endif
+}
+
+void
+UDPSession::flush(uint32_t current) noexcept {
+    // ikcp_flush does nothing until the first Update
+    m_kcp->current = current;
+    ikcp_flush(m_kcp);
+
+    Transport *io = m_listener != nullptr ? m_listener->m_io : m_io;
+    if (io != nullptr) {
+        io->Flush();
+    }
+}
+
+void
+UDPSession::SetRecvBatch(size_t n) noexcept {
+    if (m_io != nullptr) {
+        m_io->SetRecvBatch(n);
+    }
+}
+
+int
+UDPSession::UseIOUring(unsigned entries, bool sqpoll) noexcept {
+    if (m_io == nullptr) {
+        return -1;  // the socket belongs to the listener
+    }
+    return setTransport(UringTransport::Create(m_sockfd, entries, sqpoll));
+}
+
+int
+UDPSession::UseXDP(const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) noexcept {
+    if (m_io == nullptr) {
+        return -1;  // the socket belongs to the listener
+    }
+    return setTransport(XdpTransport::Create(m_sockfd, ifname, queue, gwmac, native));
+}
+
+int
+UDPSession::SetKey(const byte *key, size_t keylen) noexcept {
+    if (m_listener != nullptr) {
+        return -1;  // the key belongs to the listener
+    }
+
+    AEAD *c = AEAD::New(key, keylen);
+    if (c == nullptr) {
+        return -1;
+    }
+    AEAD::Destroy(m_aead);
+    m_aead = c;
+    grow(size_t(m_kcp->mtu) + overhead());
+    return 0;
+}
+
+AEAD *
+UDPSession::aead() const noexcept {
+    return m_listener != nullptr ? m_listener->m_aead : m_aead;
+}
+
+int
+UDPSession::setTransport(Transport *io) noexcept {
+    if (io == nullptr) {
+        return -1;
+    }
+
+    m_io->Flush();
+    if (m_loop != nullptr && m_loop->rebind(this, m_io->Fd(), io->Fd()) < 0) {
+        delete io;
+        return -1;
+    }
+    delete m_io;
+    m_io = io;
+    return 0;
+}
+
+int
+UDPSession::SetGRO(bool enable) noexcept {
+    if (m_io == nullptr) {
+        return -1;  // the socket belongs to the listener
+    }
+    return m_io->SetGRO(enable);
+}
+
 void
 UDPSession::SetStreamMode(bool enable) noexcept {
     if (enable) {
         this->m_kcp->stream = 1;
+        m_stamps = false;
     } else {
         this->m_kcp->stream = 0;
     }
 }
 
+int
+UDPSession::SetLatencyStamps(bool enable) noexcept {
+    if (enable && m_kcp->stream) {
+        return -1;
+    }
+    m_stamps = enable;
+    return 0;
+}
+
+SessionStats
+UDPSession::GetStats() const noexcept {
+    SessionStats stats = m_stats;
+    stats.conv = m_kcp->conv;
+    stats.mtu = m_kcp->mtu;
+    stats.pathMtu = uint32_t(m_pmtuSize);
+    stats.srtt = uint32_t(m_kcp->rx_srtt);
+    stats.rttvar = uint32_t(m_kcp->rx_rttval);
+    stats.rto = uint32_t(m_kcp->rx_rto);
+    stats.cwnd = m_kcp->cwnd;
+    stats.sndwnd = m_kcp->snd_wnd;
+    stats.rmtwnd = m_kcp->rmt_wnd;
+    stats.waitsnd = uint32_t(ikcp_waitsnd(m_kcp));
+    stats.state = m_kcp->state;
+    stats.retransSegs = m_kcp->xmit;
+    if (m_io != nullptr) {
+        stats.rxDrops = m_io->RxDrops();
+        stats.txDrops = m_io->TxDrops();
+    }
+    return stats;
+}
+
+int
+UDPSession::SetStatsExporter(StatsExporter *exp) noexcept {
+    if (m_exporter != nullptr) {
+        m_exporter->Release(m_statsSlot);
+        m_exporter = nullptr;
+        m_statsSlot = -1;
+    }
+
+    if (exp == nullptr) {
+        return 0;
+    }
+
+    int slot = exp->Acquire(statsKindSession);
+    if (slot < 0) {
+        return -1;
+    }
+    m_exporter = exp;
+    m_statsSlot = slot;
+    return 0;
+}
+
 /*
  * 被kcp调用的用于向网络中发送数据的回调函数
  */
@@ -226,13 +820,13 @@ int
 UDPSession::out_wrapper(const char *buf, int len, struct IKCPCB *, void *user) {
     assert(user != nullptr);
     UDPSession *sess = static_cast<UDPSession *>(user);
+    byte *pkt = sess->m_buf.data() + sess->headroom();  // the nonce goes in front when sealed
 
     if (sess->fec.isEnabled()) {    // append FEC header
         // extend to len + fecHeaderSizePlus2
         // i.e. 4B seqid + 2B flag + 2B size
-        memcpy(sess->m_buf + fecHeaderSizePlus2, buf, static_cast<size_t>(len));
-        sess->fec.MarkData(sess->m_buf, static_cast<uint16_t>(len)); // [seqid] [type id] [[len] [data]]
-        sess->output(sess->m_buf, len + fecHeaderSizePlus2);        // 发送端在构造完整个packet之后，将它发送出去
+        memcpy(pkt + fecHeaderSizePlus2, buf, static_cast<size_t>(len));
+        sess->fec.MarkData(pkt, static_cast<uint16_t>(len)); // [seqid] [type id] [[len] [data]]
         // 这部分是source symbol
         // len = length（实际的data数据长度，再加上2字节长度字段
 
@@ -253,7 +847,11 @@ UDPSession::out_wrapper(const char *buf, int len, struct IKCPCB *, void *user) {
         // row_type代表一个symbol，shards代表一个block
         // pkt_idx就是esi
         sess->shards[sess->pkt_idx++] = std::make_shared<std::vector<byte>>
-                (&sess->m_buf[fecHeaderSize], &sess->m_buf[fecHeaderSize + slen]);
+                (&pkt[fecHeaderSize], &pkt[fecHeaderSize + slen]);
+
+        // copied before sending, output seals the packet in place and the receiver
+        // decodes plaintext shards
+        sess->output(pkt, len + fecHeaderSizePlus2);        // 发送端在构造完整个packet之后，将它发送出去
 
         // count number of data shards
         if (sess->pkt_idx == sess->dataShards) { // we've collected enough data shards
@@ -262,22 +860,46 @@ UDPSession::out_wrapper(const char *buf, int len, struct IKCPCB *, void *user) {
             for (size_t i = sess->dataShards; i < sess->dataShards + sess->parityShards; i++) {
                 // append header to parity shards
                 // i.e. fecHeaderSize + data(2B size included)
-                memcpy(sess->m_buf + fecHeaderSize, sess->shards[i]->data(), sess->shards[i]->size());
-                sess->fec.MarkFEC(sess->m_buf);
-                sess->output(sess->m_buf, sess->shards[i]->size() + fecHeaderSize);
+                memcpy(pkt + fecHeaderSize, sess->shards[i]->data(), sess->shards[i]->size());
+                sess->fec.MarkFEC(pkt);
+                sess->m_stats.fecParityShards++;
+                sess->output(pkt, sess->shards[i]->size() + fecHeaderSize);
             }
 
             // reset indexing
             sess->pkt_idx = 0;
         }
-    } else { // No FEC, just send raw bytes,
+    } else { // No FEC, just send raw bytes, sealing copies them into m_buf on the way
         sess->output(buf, static_cast<size_t>(len));
     }
     return 0;
 }
 
+/*
+ * 数据包先放入批量发送队列，Update结束时由一次sendmmsg统一发出
+ * 监听端接受的会话共享监听socket的队列
+ */
 ssize_t
 UDPSession::output(const void *buffer, size_t length) {
-    ssize_t n = send(m_sockfd, buffer, length, 0);
-    return n;
-}
\ No newline at end of file
+    Transport *io = m_io;
+    const struct sockaddr *addr = nullptr;
+    if (m_listener != nullptr) {
+        io = m_listener->m_io;
+        addr = (const struct sockaddr *) &m_raddr;
+    }
+
+    AEAD *c = aead();
+    if (c != nullptr) {
+        // in place for packets built behind the headroom of m_buf
+        length = c->Seal(m_buf.data(), static_cast<const byte *>(buffer), length);
+        buffer = m_buf.data();
+    }
+
+    if (io == nullptr || !io->Send(buffer, length, addr, m_raddrlen)) {
+        return -1;
+    }
+
+    m_stats.outPkts++;
+    m_stats.outBytes += length;
+    return ssize_t(length);
+}
@@ -3,22 +3,83 @@
 
 #include "ikcp.h"
 #include "fec.h"
+#include "stats.h"
+#include "transport.h"
+#include "crypt.h"
+#include "pmtu.h"
+#include "clock.h"
+#include "histogram.h"
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+const size_t kcpHeaderSize = 24;    // IKCP_OVERHEAD, the smallest valid kcp packet
+const size_t sessBufSize = 2048;    // m_buf size until a larger mtu is set
+const uint32_t checkIdle = 0x7fffffff;  // Check's wait for an Idle session, the farthest a wrapping ms clock tells apart
+const size_t latencyStampSize = 4;  // send time in clock microseconds in front of every message, see SetLatencyStamps
+const size_t kcpMaxFragments = 255; // ikcp_send refuses a message cut into more segments
+
+class UDPListener;
+
+class EventLoop;
+
+class ThreadedSession;
+
+// Waiter is a suspended caller (e.g. a coroutine frame) which an event loop resumes
+// by calling resume(frame) once the condition it waits for holds. If the session or
+// listener it waits on is destroyed first, it is never resumed, destroy(frame) frees
+// it instead, nullptr if there is nothing to free.
+struct Waiter {
+    void *frame;
+    void (*resume)(void *frame);
+    void (*destroy)(void *frame);
+};
+
+// dropWaiter frees a waiter which will never be resumed and clears it.
+inline void dropWaiter(Waiter &w) noexcept {
+    if (w.frame != nullptr && w.destroy != nullptr) {
+        w.destroy(w.frame);
+    }
+    w = Waiter{};
+}
 
 class UDPSession  {
 private:
     int m_sockfd{0};
+    UDPListener *m_listener{nullptr};   // non-null for sessions accepted by a listener
+    EventLoop *m_loop{nullptr};         // non-null for sessions driven by an event loop
+    ThreadedSession *m_front{nullptr};  // threaded front-end fed by the event loop
+    Waiter m_readWaiter{};              // resumed by the event loop once Read has data
+    Waiter m_writeWaiter{};             // resumed by the event loop once Writable
+    bool m_touched{false};              // got input in the current event loop round
+    bool m_busyPoll{false};             // Write flushes at once instead of on the next tick
+    struct sockaddr_storage m_raddr{};  // remote address, used with the listener socket
+    socklen_t m_raddrlen{0};
     ikcpcb *m_kcp{nullptr};
-    byte m_buf[2048];
-    byte m_streambuf[65535];
-    size_t m_streambufsiz{0};
+    std::vector<byte> m_buf;            // [nonce] [FEC header] [kcp packet] [tag] when sealed
+    int m_kcpBuf{0};                    // largest mtu kcp's flush buffer was allocated for
+    PathMTU m_pmtu;
+    size_t m_pmtuSize{0};               // udp payload applied from path mtu discovery
+    size_t m_pmtuBase{0};               // payload before discovery, restored if the peer never answers
+    AEAD *m_aead{nullptr};              // owned, accepted sessions use the listener's
+    Transport *m_io{nullptr};           // datagrams produced by one flush are sent at the end of Update
+    std::vector<char> m_streambuf;      // message not fully read yet, grows to the largest message
+    size_t m_streamoff{0};              // bytes of m_streambuf already read
+    bool m_stamps{false};               // messages carry their send time, see SetLatencyStamps
+    std::vector<char> m_sendbuf;        // stamped message handed to kcp
+    Histogram m_latency;                // Write to Read latency of stamped messages in us
 
     FEC fec;
     uint32_t pkt_idx{0};
     std::vector<row_type> shards;
     size_t dataShards{0};
     size_t parityShards{0};
+
+    SessionStats m_stats{};
+    StatsExporter *m_exporter{nullptr};
+    int m_statsSlot{-1};
 public:
     UDPSession(const UDPSession &) = delete;
 
@@ -27,27 +88,140 @@ public:
     // Dial connects to the remote server and returns UDPSession.
     static UDPSession *Dial(const char *ip, uint16_t port);
 
-    // DialWithOptions connects to the remote address "raddr" on the network "udp" with packet encryption
+    // DialWithOptions connects to the remote address "raddr" on the network "udp" with FEC,
+    // call SetKey to enable packet encryption.
     static UDPSession *DialWithOptions(const char *ip, uint16_t port, size_t dataShards, size_t parityShards);
 
-    // Update will try reading/writing udp packet, pass current unix millisecond
+    // DialTransport creates a session on "io" instead of a socket, e.g. an EmuLink
+    // endpoint, and takes ownership of it. Both peers have to agree on "conv".
+    // Socket options (DSCP, busy poll, path mtu discovery) fail on such a session.
+    static UDPSession *DialTransport(Transport *io, uint32_t conv, size_t dataShards, size_t parityShards);
+
+    // Update will try reading/writing udp packet, pass currentMs(). Write flushes at
+    // currentMs() in busy poll mode, so any other time base must not be mixed with it.
+    // For sessions accepted by a listener, reading and sending is done by UDPListener::Update.
     void Update(uint32_t current) noexcept;
 
+    // Check returns the millisecond at which Update should be called next,
+    // provided no packet arrives and Write is not called in between. An Idle session
+    // has no deadline, Check returns current + checkIdle for it.
+    uint32_t Check(uint32_t current) noexcept;
+
+    // Idle reports whether the session has nothing to send, resend, ack or probe, so
+    // that its interval ticks would flush nothing. Only input, Write or a Read making
+    // room in the receive window (a window update) give Update something to do again.
+    bool Idle() const noexcept;
+
     // Destroy release all resource related.
     static void Destroy(UDPSession *sess);
 
     // Read reads from kcp with buffer empty sz.cc
     ssize_t Read(char *buf, size_t sz) noexcept;
 
+    // PeekSize returns the size of the next message (or of its unread remainder), 0 if there is none.
+    size_t PeekSize() const noexcept;
+
+    // Readv is Read scattering into "iovcnt" buffers. It stops at the end of a message,
+    // except in stream mode, where it goes on until the buffers are full.
+    ssize_t Readv(const struct iovec *iov, int iovcnt) noexcept;
+
     // Write writes into kcp with buffer empty sz.
     ssize_t Write(const char *buf, size_t sz) noexcept;
 
-    // Set DSCP value
+    // SetGRO toggles receiving coalesced runs of datagrams in one buffer (UDP_GRO),
+    // returns the setsockopt result.
+    int SetGRO(bool enable) noexcept;
+
+    // UseIOUring switches to the io_uring backend (multishot recvmsg on a provided
+    // buffer ring, batched sendmsg), optionally with a kernel SQPOLL thread.
+    // Returns -1 if the kernel lacks support, the socket backend is kept then.
+    // GRO and GSO are not available on this backend.
+    int UseIOUring(unsigned entries, bool sqpoll) noexcept;
+
+    // UseXDP switches to an AF_XDP socket on queue "queue" of "ifname", bypassing the
+    // kernel udp stack for ipv4 traffic to the local address, see XdpTransport.
+    // "gwmac" is the next hop for destinations which have not been heard from yet.
+    int UseXDP(const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) noexcept;
+
+    // SetRxTimestamps toggles kernel receive timestamps (SO_TIMESTAMPNS), on by default.
+    // RTT samples are then taken at the arrival of an ack rather than at the Update which
+    // reads it, so time spent queued in the socket or waiting for Update doesn't inflate
+    // RTT and RTO. The queueing delay is reported in rxDelay and rxDelayMax.
+    // Only the socket backend stamps datagrams.
+    int SetRxTimestamps(bool enable) noexcept;
+
+    // SetGSO toggles sending runs of equal-size datagrams as one UDP_SEGMENT super-buffer.
+    void SetGSO(bool enable) noexcept;
+
+    // SetSockBufMax caps SO_RCVBUF and SO_SNDBUF, which are doubled whenever the kernel
+    // runs out of room in that direction, default defaultSockBufMax, 0 leaves them alone.
+    // Such drops are counted in rxDrops and txDrops apart from loss on the wire, but kcp
+    // still retransmits them and shrinks cwnd as for any loss, so keep the buffers large
+    // enough to absorb the gaps between two Updates. Beyond net.core.rmem_max/wmem_max
+    // the buffers only grow with CAP_NET_ADMIN. For sessions accepted by a listener, the
+    // socket is set by the listener.
+    void SetSockBufMax(size_t max) noexcept;
+
+    // Set DSCP value, sessions accepted by a listener return -1, the socket is set
+    // by UDPListener::SetDSCP.
     int SetDSCP(int dscp) noexcept;
 
+    // SetBusyPoll trades a core for latency: the socket busy polls the device queue
+    // for up to "usecs" (SO_BUSY_POLL, SO_PREFER_BUSY_POLL) on receive, and Write calls
+    // ikcp_flush at once instead of waiting for the next interval tick. Pair it with
+    // EventLoop::SetBusyPoll. Pass 0 to switch it off. For sessions accepted by a
+    // listener only the flush applies, the socket is set by UDPListener::SetBusyPoll.
+    // Returns the setsockopt result, raising SO_BUSY_POLL needs CAP_NET_ADMIN.
+    int SetBusyPoll(int usecs) noexcept;
+
+    // SetKey seals every datagram with ChaCha20-Poly1305 under a 32 byte key shared with
+    // the peer, see AEAD. Datagrams failing authentication are dropped and counted in
+    // cryptErrs. Every datagram grows by cryptOverhead bytes, leave room for it in the mtu.
+    // Sessions accepted by a listener use the listener's key.
+    int SetKey(const byte *key, size_t keylen) noexcept;
+
+    // SetRecvBatch sets how many datagrams are read per recvmmsg, default defaultRecvBatch.
+    void SetRecvBatch(size_t n) noexcept;
+
     // SetStreamMode toggles the stream mode on/off
     void SetStreamMode(bool enable) noexcept;
 
+    // SetLatencyStamps toggles send timestamps: Write puts the send time (latencyStampSize
+    // bytes of clock microseconds) in front of every message and Read takes it off again,
+    // recording the time from the peer's Write to the Read handing the message over in
+    // Latency. Compare it with srtt: the network accounts for about srtt/2, a long tail
+    // is retransmission waits, a shift of every percentile is time the message sat in the
+    // receive queue until the application read it. The stamp is the sender's clock, so
+    // across hosts the clocks have to be in sync, negative latencies count as 0.
+    // Both peers have to enable it before writing. Stream mode loses message boundaries,
+    // so it fails with -1 there, and SetStreamMode(true) turns it off.
+    int SetLatencyStamps(bool enable) noexcept;
+
+    // Latency returns the histogram of message latencies in microseconds, Reset it to
+    // start a new interval, Merge it with those of other sessions to aggregate them.
+    inline Histogram &Latency() noexcept { return m_latency; }
+
+    // Writable reports whether kcp has send window space left for Write.
+    bool Writable() const noexcept;
+
+    // MaxMessage returns the largest message Write takes, kcpMaxFragments segments of
+    // the current mss. It shrinks with the mtu, e.g. at the start of path mtu discovery.
+    size_t MaxMessage() const noexcept;
+
+    // AwaitReadable registers "w" to be resumed by the session's event loop as soon as
+    // Read has data, AwaitWritable as soon as Writable holds. There is one waiter per
+    // direction, a new one replaces the old one. Waiters of a destroyed session are dropped.
+    void AwaitReadable(Waiter w) noexcept;
+
+    void AwaitWritable(Waiter w) noexcept;
+
+    // GetStats returns a snapshot of the session counters and kcp state.
+    SessionStats GetStats() const noexcept;
+
+    // SetStatsExporter publishes the session counters into "exp" on every Update,
+    // pass nullptr to stop publishing. Returns -1 if the exporter has no free slot.
+    int SetStatsExporter(StatsExporter *exp) noexcept;
+
     // Wrappers for kcp control
     inline int NoDelay(int nodelay, int interval, int resend, int nc) {
         return ikcp_nodelay(m_kcp, nodelay, interval, resend, nc);
@@ -55,7 +229,23 @@ public:
 
     inline int WndSize(int sndwnd, int rcvwnd) { return ikcp_wndsize(m_kcp, sndwnd, rcvwnd); }
 
-    inline int SetMtu(int mtu) { return ikcp_setmtu(m_kcp, mtu); }
+    // SetMtu sets the kcp packet size, FEC and encryption headers come on top of it.
+    // Buffers grow for jumbo sizes.
+    int SetMtu(int mtu) noexcept;
+
+    // SetPathMTUDiscovery probes the path for the largest udp payload that gets through
+    // with DF set, up to "linkMtu" (e.g. 9000) minus ip and udp headers, and keeps the
+    // kcp mtu in step, see PathMTU. The peer answers probes without further setup, but
+    // receives jumbo datagrams only if it made room for them with SetMtu or
+    // SetPathMTUDiscovery itself. Pass 0 to stop probing, the mtu found is kept.
+    // For sessions accepted by a listener, the socket is set by the listener.
+    //
+    // kcp can't cut segments again once they are queued, so data is sent at the ip
+    // minimum until a larger size is confirmed, call it before writing. Meanwhile
+    // messages are cut into more fragments, which the peer's receive window must hold.
+    // If the peer doesn't answer probes the previous mtu is restored. Should the path
+    // shrink later, segments queued for the old size only get through once it grows back.
+    int SetPathMTUDiscovery(size_t linkMtu) noexcept;
 
 private:
     UDPSession() = default;
@@ -68,18 +258,63 @@ private:
     // out_wrapper
     static int out_wrapper(const char *buf, int len, struct IKCPCB *kcp, void *user);
 
-    // output udp packet
+    // grow makes room for udp payloads of up to "payload" bytes, returns the size the
+    // transport carries.
+    size_t grow(size_t payload) noexcept;
+
+    // setKcpMtu changes the kcp mtu without shrinking its flush buffer, segments cut
+    // for a larger mtu may still be queued.
+    int setKcpMtu(int mtu) noexcept;
+
+    // overhead returns the FEC and encryption bytes added to every kcp packet.
+    size_t overhead() const noexcept;
+
+    // probe sends a path mtu probe of "len" bytes on the wire, see pmtu.h.
+    void probe(uint8_t kind, size_t size, uint32_t seq, size_t len) noexcept;
+
+    // onProbe answers a probe request or records the answer to ours.
+    void onProbe(byte *data, size_t n, uint32_t current) noexcept;
+
+    // flush sends everything kcp has queued now, outside of Update.
+    void flush(uint32_t current) noexcept;
+
+    // output queues an udp packet, it is sent at the end of Update. Sealed packets are
+    // built in m_buf behind headroom() bytes, so that they are encrypted in place.
     ssize_t output(const void *buffer, size_t length);
 
+    // aead returns the cipher of this session, nullptr if encryption is off.
+    AEAD *aead() const noexcept;
+
+    inline size_t headroom() const noexcept { return aead() != nullptr ? cryptNonceSize : 0; }
+
     static UDPSession *createSession(int sockfd);
 
+    // setTransport replaces the transport with "io", which may be nullptr if creating it failed.
+    int setTransport(Transport *io) noexcept;
+
+    // acceptSession creates a session which shares the listener socket.
+    static UDPSession *acceptSession(UDPListener *l, const struct sockaddr *addr, socklen_t addrlen, uint32_t conv);
+
+    // recvMessage moves the next kcp message into m_streambuf, returns its size or 0.
+    size_t recvMessage() noexcept;
+
+    // received follows every ikcp_recv, it schedules the window update kcp may ask for.
+    void received() noexcept;
+
+    // input feeds one datagram into FEC and kcp. "current" is the time of this round,
+    // "delay" the microseconds the datagram was queued since its arrival (0 if unknown),
+    // so that acks are timed against the arrival instead of the round.
+    void input(byte *data, size_t n, uint32_t current, uint32_t delay) noexcept;
+
+    friend class UDPListener;
 
+    friend class EventLoop;
 };
 
+// currentMs returns the monotonic millisecond of the installed Clock (see SetClock), the
+// time base for Update and Check. It doesn't jump when NTP steps the wall clock.
 inline uint32_t currentMs() {
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    return uint32_t((time.tv_sec * 1000) + (time.tv_usec / 1000));
+    return uint32_t(clockMonotonic() / 1000000);
 }
 
 
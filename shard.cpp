@@ -0,0 +1,124 @@
+#include "shard.h"
+#include <pthread.h>
+#include <sched.h>
+
+ShardedServer *
+ShardedServer::Listen(const char *ip, uint16_t port, size_t shards, size_t dataShards, size_t parityShards) {
+    if (shards == 0) {
+        return nullptr;
+    }
+
+    ShardedServer *srv = new(ShardedServer);
+    for (size_t i = 0; i < shards; i++) {
+        // with port 0 the first socket picks the port, the others join it
+        auto l = UDPListener::ListenReusePort(ip, port, dataShards, parityShards);
+        auto loop = EventLoop::Create();
+        if (l == nullptr || loop == nullptr || loop->Add(l) < 0) {
+            UDPListener::Destroy(l);
+            EventLoop::Destroy(loop);
+            ShardedServer::Destroy(srv);
+            return nullptr;
+        }
+        if (port == 0) {
+            port = l->Port();
+        }
+        srv->m_shards.push_back(Shard{i, l, loop});
+    }
+    srv->m_port = port;
+    return srv;
+}
+
+void
+ShardedServer::Destroy(ShardedServer *srv) {
+    if (nullptr == srv) return;
+    srv->Stop();
+    for (auto &shard : srv->m_shards) {
+        UDPListener::Destroy(shard.listener);
+        EventLoop::Destroy(shard.loop);
+    }
+    delete srv;
+}
+
+int
+ShardedServer::SteerByConv() noexcept {
+    // the program is shared by the whole reuseport group, and the socket index it
+    // returns follows bind order, which is shard order. Attaching it again from the
+    // other shards replaces it with itself, but switches their sessions to conv keys.
+    for (auto &shard : m_shards) {
+        if (shard.listener->SteerByConv(m_shards.size()) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+ShardedServer::UseIOUring(unsigned entries, bool sqpoll) noexcept {
+    for (auto &shard : m_shards) {
+        if (shard.listener->UseIOUring(entries, sqpoll) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+ShardedServer::Start(AcceptHandler onAccept, RoundHandler onRound, bool pin) noexcept {
+    if (m_running.exchange(true)) {
+        return -1;
+    }
+
+    m_onAccept = onAccept;
+    m_onRound = onRound;
+    unsigned ncpu = std::thread::hardware_concurrency();
+    for (auto &shard : m_shards) {
+        m_threads.emplace_back(&ShardedServer::run, this, std::ref(shard));
+#ifdef __linux__
+        if (pin && ncpu > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(shard.index % ncpu, &set);
+            pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(set), &set);
+        }
+#else
+        (void) pin;
+        (void) ncpu;
+#endif
+    }
+    return 0;
+}
+
+void
+ShardedServer::Stop() noexcept {
+    m_running = false;
+    for (auto &t : m_threads) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    m_threads.clear();
+}
+
+/*
+ * 每个worker线程独占一个监听socket、会话表和事件循环，
+ * 会话不会在线程间迁移，因此热路径上没有任何锁
+ */
+void
+ShardedServer::run(Shard &shard) noexcept {
+    while (m_running.load(std::memory_order_relaxed)) {
+        shard.loop->RunOnce(shardPollTimeout);
+
+        UDPSession *sess;
+        while ((sess = shard.listener->Accept()) != nullptr) {
+            if (m_onAccept) {
+                m_onAccept(shard, sess);
+            } else {
+                UDPSession::Destroy(sess);
+            }
+        }
+
+        if (m_onRound) {
+            m_onRound(shard);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef KCP_SHARD_H
+#define KCP_SHARD_H
+
+#include "eventloop.h"
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+const int shardPollTimeout = 50; // ms, bounds how long Stop waits for a worker
+
+// Shard is the state owned by one worker thread. Sessions never migrate
+// between shards, so nothing in here needs a lock.
+struct Shard {
+    size_t index;
+    UDPListener *listener;
+    EventLoop *loop;
+};
+
+// ShardedServer runs N workers, each with its own SO_REUSEPORT socket, session
+// table and event loop. The kernel spreads incoming flows across the sockets.
+class ShardedServer {
+public:
+    // AcceptHandler is called on the worker thread for every new session, the handler
+    // owns the session and must destroy it on that same thread.
+    using AcceptHandler = std::function<void(Shard &shard, UDPSession *sess)>;
+
+    // RoundHandler is called on the worker thread after every event loop round,
+    // it is the place to Read from and Write to the shard's sessions.
+    using RoundHandler = std::function<void(Shard &shard)>;
+
+    ShardedServer(const ShardedServer &) = delete;
+
+    ShardedServer &operator=(const ShardedServer &) = delete;
+
+    // Listen binds "shards" sockets to ip:port, port 0 picks one port for all of them.
+    static ShardedServer *Listen(const char *ip, uint16_t port, size_t shards, size_t dataShards, size_t parityShards);
+
+    // Destroy stops the workers and release all resource related, sessions still
+    // held by the application must have been destroyed by then.
+    static void Destroy(ShardedServer *srv);
+
+    // SteerByConv routes datagrams to shard "conv % Shards()" instead of hashing
+    // the address, and keys the sessions of every shard by conv, see
+    // UDPListener::SteerByConv. Call it before Start.
+    int SteerByConv() noexcept;
+
+    // UseIOUring switches every shard to the io_uring backend, call it before Start.
+    int UseIOUring(unsigned entries, bool sqpoll) noexcept;
+
+    // Start launches one thread per shard, pinned to a core if "pin" is set.
+    int Start(AcceptHandler onAccept, RoundHandler onRound, bool pin) noexcept;
+
+    // Stop asks the workers to exit and joins them.
+    void Stop() noexcept;
+
+    inline size_t Shards() const { return m_shards.size(); }
+
+    inline Shard &At(size_t i) { return m_shards[i]; }
+
+    inline uint16_t Port() const { return m_port; }
+
+private:
+    ShardedServer() = default;
+
+    ~ShardedServer() = default;
+
+    void run(Shard &shard) noexcept;
+
+    uint16_t m_port{0};
+    std::vector<Shard> m_shards;
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_running{false};
+    AcceptHandler m_onAccept;
+    RoundHandler m_onRound;
+};
+
+#endif //KCP_SHARD_H
@@ -0,0 +1,123 @@
+//
+// shard_test checks that with SteerByConv a session on a shard other than the
+// first survives a rebinding of its peer: the peer moves to a new local port, the
+// program steers it back to the same shard by conv, and the shard migrates the
+// session instead of accepting a new one. Listeners with FEC or a key must refuse
+// to steer.
+//
+#include <iostream>
+#include <cstring>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "shard.h"
+
+static int g_fd;
+static struct sockaddr_in g_srv;
+
+static int
+output(const char *buf, int len, ikcpcb *, void *) {
+    sendto(g_fd, buf, size_t(len), 0, (struct sockaddr *) &g_srv, sizeof(g_srv));
+    return 0;
+}
+
+// parity shards carry no conv to steer by and a key seals it, so neither mixes
+// with steering
+static bool testSteerRefusals() {
+    ShardedServer *srv = ShardedServer::Listen("127.0.0.1", 0, 2, 2, 2);
+    bool ok = srv != nullptr && srv->SteerByConv() < 0;
+    ShardedServer::Destroy(srv);
+    std::cout << "steer with fec: " << (ok ? "refused" : "ACCEPTED") << std::endl;
+
+    byte key[cryptKeySize] = {1};
+    UDPListener *l = UDPListener::ListenReusePort("127.0.0.1", 0, 0, 0);
+    bool keyed = l->SetKey(key, sizeof(key)) == 0 && l->SteerByConv(1) < 0;
+    UDPListener::Destroy(l);
+    std::cout << "steer with key: " << (keyed ? "refused" : "ACCEPTED") << std::endl;
+
+    l = UDPListener::ListenReusePort("127.0.0.1", 0, 0, 0);
+    bool steered = l->SteerByConv(1) < 0 || l->SetKey(key, sizeof(key)) < 0;
+    UDPListener::Destroy(l);
+    std::cout << "key when steering: " << (steered ? "refused" : "ACCEPTED") << std::endl;
+    return ok && keyed && steered;
+}
+
+int main() {
+    if (!testSteerRefusals()) {
+        std::cout << "FAIL" << std::endl;
+        return 1;
+    }
+
+    const size_t shards = 2;
+    const uint32_t conv = 4243;     // conv % shards == 1
+    ShardedServer *srv = ShardedServer::Listen("127.0.0.1", 0, shards, 0, 0);
+    if (srv == nullptr) {
+        std::cout << "FAIL: listen" << std::endl;
+        return 1;
+    }
+    if (srv->SteerByConv() < 0) {
+        std::cout << "SKIP: SO_ATTACH_REUSEPORT_CBPF unsupported" << std::endl;
+        ShardedServer::Destroy(srv);
+        return 0;
+    }
+
+    memset(&g_srv, 0, sizeof(g_srv));
+    g_srv.sin_family = AF_INET;
+    g_srv.sin_port = htons(srv->Port());
+    g_srv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // the peer rebinds between the rounds, its kcp state carries on
+    int fds[2] = {socket(AF_INET, SOCK_DGRAM, 0), socket(AF_INET, SOCK_DGRAM, 0)};
+    ikcpcb *kcp = ikcp_create(conv, nullptr);
+    ikcp_setoutput(kcp, output);
+    ikcp_nodelay(kcp, 1, 10, 2, 1);
+
+    UDPSession *sess[shards] = {};
+    int accepted[shards] = {};
+    int echoed = 0;
+    char buf[64];
+    for (int round = 0; round < 2; round++) {
+        g_fd = fds[round];
+        ikcp_send(kcp, "hello", 5);
+        for (int i = 0; i < 50; i++) {
+            ikcp_update(kcp, currentMs());
+            for (size_t k = 0; k < shards; k++) {
+                Shard &shard = srv->At(k);
+                shard.loop->RunOnce(0);
+                UDPSession *s;
+                while ((s = shard.listener->Accept()) != nullptr) {
+                    accepted[k]++;
+                    UDPSession::Destroy(sess[k]);
+                    sess[k] = s;
+                }
+                while (sess[k] != nullptr && sess[k]->Read(buf, sizeof(buf)) > 0) {
+                    sess[k]->Write(buf, 5);
+                    echoed++;
+                }
+            }
+            ssize_t n;
+            while ((n = recv(g_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                ikcp_input(kcp, buf, long(n));
+            }
+            usleep(2000);
+        }
+    }
+
+    int replies = 0;
+    while (ikcp_recv(kcp, buf, sizeof(buf)) > 0) {
+        replies++;
+    }
+    ListenerStats st = srv->At(1).listener->GetStats();
+    std::cout << "shard 0 accepted " << accepted[0] << ", shard 1 accepted " << accepted[1]
+              << ", migrated " << st.migrated << ", echoed " << echoed << ", replies " << replies << std::endl;
+    bool ok = accepted[0] == 0 && accepted[1] == 1 && st.migrated == 1 && echoed == 2 && replies == 2;
+
+    for (size_t k = 0; k < shards; k++) {
+        UDPSession::Destroy(sess[k]);
+    }
+    ikcp_release(kcp);
+    close(fds[0]);
+    close(fds[1]);
+    ShardedServer::Destroy(srv);
+    std::cout << (ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include "stats.h"
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+StatsExporter *
+StatsExporter::Open(const char *path, size_t capacity) {
+    if (capacity == 0) {
+        return nullptr;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    size_t len = sizeof(statsHeader) + capacity * sizeof(statsSlot);
+    if (ftruncate(fd, off_t(len)) < 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file referenced
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // slots are zero filled by ftruncate, i.e. seq = 0 and kind = statsKindFree
+    for (size_t i = 0; i < capacity; i++) {
+        auto s = reinterpret_cast<statsSlot *>(static_cast<char *>(base) + sizeof(statsHeader)) + i;
+        new(&s->seq) std::atomic<uint32_t>(0);
+    }
+
+    // header goes last, so a reader never sees the magic on a half initialized file
+    auto hdr = static_cast<statsHeader *>(base);
+    hdr->version = statsVersion;
+    hdr->headerSize = sizeof(statsHeader);
+    hdr->slotSize = sizeof(statsSlot);
+    hdr->capacity = uint32_t(capacity);
+    std::atomic_thread_fence(std::memory_order_release);
+    hdr->magic = statsMagic;
+
+    StatsExporter *exp = new(StatsExporter);
+    exp->m_base = base;
+    exp->m_len = len;
+    exp->m_capacity = capacity;
+    exp->m_free.reserve(capacity);
+    for (size_t i = capacity; i > 0; i--) {
+        exp->m_free.push_back(int(i - 1));
+    }
+    return exp;
+}
+
+void
+StatsExporter::Destroy(StatsExporter *exp) {
+    if (nullptr == exp) return;
+    if (nullptr != exp->m_base) { munmap(exp->m_base, exp->m_len); }
+    delete exp;
+}
+
+statsSlot *
+StatsExporter::slotAt(int slot) noexcept {
+    return reinterpret_cast<statsSlot *>(static_cast<char *>(m_base) + sizeof(statsHeader)) + slot;
+}
+
+int
+StatsExporter::Acquire(uint32_t kind) noexcept {
+    if (m_free.empty()) {
+        return -1;
+    }
+
+    int slot = m_free.back();
+    m_free.pop_back();
+
+    auto s = slotAt(slot);
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s->kind = kind;
+    s->updated = 0;
+    memset(s->payload, 0, sizeof(s->payload));
+    s->seq.store(seq + 2, std::memory_order_release);
+    return slot;
+}
+
+void
+StatsExporter::Release(int slot) noexcept {
+    if (slot < 0 || size_t(slot) >= m_capacity) {
+        return;
+    }
+
+    auto s = slotAt(slot);
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s->kind = statsKindFree;
+    s->seq.store(seq + 2, std::memory_order_release);
+    m_free.push_back(slot);
+}
+
+void
+StatsExporter::Publish(int slot, const void *data, size_t sz, uint32_t current) noexcept {
+    if (slot < 0 || size_t(slot) >= m_capacity) {
+        return;
+    }
+    if (sz > statsPayloadSize) {
+        sz = statsPayloadSize;
+    }
+
+    // single writer per slot, so plain load + store is enough for the counter
+    auto s = slotAt(slot);
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(s->payload, data, sz);
+    s->updated = current;
+    s->seq.store(seq + 2, std::memory_order_release);
+}
+
+uint32_t
+StatsExporter::Read(const void *base, int slot, void *data, size_t sz, uint32_t *updated) noexcept {
+    auto hdr = static_cast<const statsHeader *>(base);
+    if (hdr->magic != statsMagic || hdr->version != statsVersion || slot < 0 || uint32_t(slot) >= hdr->capacity) {
+        return statsKindFree;
+    }
+    if (sz > statsPayloadSize) {
+        sz = statsPayloadSize;
+    }
+
+    auto s = reinterpret_cast<const statsSlot *>(static_cast<const char *>(base) + hdr->headerSize) + slot;
+    for (int i = 0; i < statsReadRetries; i++) {
+        uint32_t begin = s->seq.load(std::memory_order_acquire);
+        if (begin & 1) {
+            continue;   // writer in progress
+        }
+
+        uint32_t kind = s->kind;
+        uint32_t ts = s->updated;
+        memcpy(data, s->payload, sz);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s->seq.load(std::memory_order_relaxed) == begin) {
+            if (updated) *updated = ts;
+            return kind;
+        }
+    }
+    return statsKindBusy;
+}
@@ -0,0 +1,115 @@
+#ifndef KCP_STATS_H
+#define KCP_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Layout of the exported stats file (native byte order and alignment):
+//
+//   [statsHeader] [statsSlot 0] [statsSlot 1] ... [statsSlot capacity-1]
+//
+// Every slot is protected by its own sequence counter (seqlock). The writer makes
+// the counter odd before touching the slot and even again afterwards, a reader
+// copies the slot and retries if the counter was odd or changed in between.
+// The writer never waits for readers, so publishing costs a few stores.
+const uint32_t statsMagic = 0x5350434b;    // "KCPS"
+const uint32_t statsVersion = 1;
+const size_t statsPayloadSize = 240;
+
+// slot kinds
+const uint32_t statsKindFree = 0;
+const uint32_t statsKindSession = 1;
+const uint32_t statsKindListener = 2;
+const uint32_t statsKindBusy = 0xffffffff;  // returned by Read, the writer held the slot throughout
+
+const int statsReadRetries = 100000;    // a publish is a few stores, a writer holding the slot longer is stuck or dead
+
+struct SessionStats {
+    uint32_t conv;
+    uint32_t mtu;
+    uint32_t srtt;          // smoothed rtt in ms
+    uint32_t rttvar;        // rtt variance in ms
+    uint32_t rto;           // current retransmission timeout in ms
+    uint32_t cwnd;          // congestion window in packets
+    uint32_t sndwnd;
+    uint32_t rmtwnd;        // window advertised by the remote side
+    uint32_t waitsnd;       // packets waiting to be sent or acked
+    uint32_t state;
+    uint64_t inPkts;        // datagrams received
+    uint64_t inBytes;
+    uint64_t outPkts;       // datagrams sent, parity shards included
+    uint64_t outBytes;
+    uint64_t retransSegs;   // segments resent on rto
+    uint64_t fecParityShards;   // parity shards sent
+    uint64_t fecRecovered;      // data shards recovered by FEC
+    uint64_t fecErrs;           // recovered shards with a broken size field
+    uint64_t cryptErrs;         // datagrams failing authentication
+    uint32_t rxDelay;           // smoothed time from kernel arrival to kcp input in us
+    uint32_t rxDelayMax;        // largest such delay in us
+    uint32_t pathMtu;           // udp payload found by path mtu discovery, 0 if unknown
+    uint64_t rxDrops;           // datagrams dropped by the local kernel on a full receive queue
+    uint64_t txDrops;           // datagrams the local kernel refused to send
+};
+
+struct statsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t slotSize;
+    uint32_t capacity;
+    uint32_t reserved[3];
+};
+
+struct statsSlot {
+    std::atomic<uint32_t> seq;
+    uint32_t kind;
+    uint32_t updated;   // writer's ms clock at last publish
+    uint32_t reserved;
+    unsigned char payload[statsPayloadSize];
+};
+
+static_assert(sizeof(SessionStats) <= statsPayloadSize, "SessionStats exceeds slot payload");
+
+class StatsExporter {
+public:
+    StatsExporter(const StatsExporter &) = delete;
+
+    StatsExporter &operator=(const StatsExporter &) = delete;
+
+    // Open creates (or truncates) the file at "path" and maps "capacity" slots into memory.
+    static StatsExporter *Open(const char *path, size_t capacity);
+
+    // Destroy unmaps the region, the file itself is left for readers.
+    static void Destroy(StatsExporter *exp);
+
+    // Acquire reserves a free slot of the given kind, returns -1 if all slots are taken.
+    int Acquire(uint32_t kind) noexcept;
+
+    // Release marks the slot free again.
+    void Release(int slot) noexcept;
+
+    // Publish copies "sz" bytes of "data" into the slot under its seqlock.
+    void Publish(int slot, const void *data, size_t sz, uint32_t current) noexcept;
+
+    // Read takes a consistent snapshot of one slot from a mapped region, as an external
+    // reader would. Returns the slot kind, or statsKindFree if the slot is unused.
+    // Gives up after statsReadRetries attempts and returns statsKindBusy, e.g. when the
+    // writer died in the middle of a publish, "data" is not consistent then.
+    static uint32_t Read(const void *base, int slot, void *data, size_t sz, uint32_t *updated) noexcept;
+
+private:
+    StatsExporter() = default;
+
+    ~StatsExporter() = default;
+
+    statsSlot *slotAt(int slot) noexcept;
+
+    void *m_base{nullptr};
+    size_t m_len{0};
+    size_t m_capacity{0};
+    std::vector<int> m_free;
+};
+
+#endif //KCP_STATS_H
@@ -0,0 +1,173 @@
+#include "threaded.h"
+#include "eventloop.h"
+#include <cstring>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+ThreadedSession *
+ThreadedSession::Create(UDPSession *sess, size_t depth) {
+    if (sess == nullptr || depth == 0) {
+        return nullptr;
+    }
+
+    int iofd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int readfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (iofd < 0 || readfd < 0) {
+        if (iofd >= 0) { close(iofd); }
+        if (readfd >= 0) { close(readfd); }
+        return nullptr;
+    }
+
+    ThreadedSession *ts = new(ThreadedSession);
+    ts->m_sess = sess;
+    ts->m_writes = new MPSCQueue<message>(depth);
+    ts->m_reads = new SPSCQueue<message>(depth);
+    ts->m_iofd = iofd;
+    ts->m_readfd = readfd;
+    ts->m_maxMessage.store(sess->MaxMessage());
+    return ts;
+}
+
+void
+ThreadedSession::Destroy(ThreadedSession *ts) {
+    if (nullptr == ts) return;
+    if (nullptr != ts->m_loop) { ts->m_loop->Remove(ts); }
+    UDPSession::Destroy(ts->m_sess);
+
+    message m;
+    while (ts->m_writes->Pop(&m)) {
+        delete[] m.data;
+    }
+    for (message *f = ts->m_reads->Front(); f != nullptr; f = ts->m_reads->Front()) {
+        delete[] f->data;
+        ts->m_reads->Pop();
+    }
+    delete ts->m_writes;
+    delete ts->m_reads;
+
+    close(ts->m_iofd);
+    close(ts->m_readfd);
+    delete ts;
+}
+
+void
+ThreadedSession::signal(int fd) noexcept {
+    eventfd_write(fd, 1);
+}
+
+void
+ThreadedSession::clear(int fd) noexcept {
+    eventfd_t v;
+    eventfd_read(fd, &v);
+}
+
+void
+ThreadedSession::wakeIO() noexcept {
+    if (!m_ioSignalled.exchange(true)) {
+        signal(m_iofd);
+    }
+}
+
+ssize_t
+ThreadedSession::Write(const char *buf, size_t sz) noexcept {
+    if (sz > m_maxMessage.load(std::memory_order_relaxed)) {
+        return -2;
+    }
+    message m{new char[sz], sz};
+    memcpy(m.data, buf, sz);
+    if (!m_writes->Push(m)) {
+        delete[] m.data;
+        return -1;
+    }
+    wakeIO();
+    return ssize_t(sz);
+}
+
+ssize_t
+ThreadedSession::Read(char *buf, size_t sz) noexcept {
+    message *m = m_reads->Front();
+    if (m == nullptr) {
+        // rearm the wakeup, then look again in case a message slipped in before
+        if (m_readSignalled.exchange(false)) {
+            clear(m_readfd);
+        }
+        if ((m = m_reads->Front()) == nullptr) {
+            return 0;
+        }
+    }
+
+    size_t n = m->len - m_readoff;
+    if (n > sz) {
+        n = sz;
+    }
+    memcpy(buf, m->data + m_readoff, n);
+    m_readoff += n;
+    if (m_readoff == m->len) {
+        delete[] m->data;
+        m_reads->Pop();
+        m_readoff = 0;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_readBlocked.exchange(false)) {
+            wakeIO();
+        }
+    }
+    return ssize_t(n);
+}
+
+void
+ThreadedSession::Pump() noexcept {
+    drain();
+    deliver();
+}
+
+void
+ThreadedSession::drain() noexcept {
+    // clear the flag first, writes queued from now on signal again
+    if (m_ioSignalled.exchange(false)) {
+        clear(m_iofd);
+    }
+
+    m_maxMessage.store(m_sess->MaxMessage(), std::memory_order_relaxed);
+
+    // the rest waits in the queue for acks to make room, see EventLoop::update
+    while (m_sess->Writable()) {
+        message m;
+        if (!m_writes->Pop(&m)) {
+            break;
+        }
+        if (m_sess->Write(m.data, m.len) < 0) {
+            m_writeErrs.fetch_add(1, std::memory_order_relaxed);
+        }
+        delete[] m.data;
+    }
+}
+
+void
+ThreadedSession::deliver() noexcept {
+    bool delivered = false;
+    for (;;) {
+        if (m_reads->Full()) {
+            // the reader clears the flag after making room, look again after setting it
+            m_readBlocked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_reads->Full()) {
+                break;
+            }
+            m_readBlocked.store(false);
+        }
+
+        size_t n = m_sess->PeekSize();
+        if (n == 0) {
+            break;
+        }
+
+        message m{new char[n], n};
+        m_sess->Read(m.data, n);
+        m_reads->Push(m);
+        delivered = true;
+    }
+
+    if (delivered && !m_readSignalled.exchange(true)) {
+        signal(m_readfd);
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef KCP_THREADED_H
+#define KCP_THREADED_H
+
+#include "sess.h"
+#include "queue.h"
+#include <atomic>
+
+const size_t defaultQueueDepth = 1024;  // messages queued per direction
+
+// ThreadedSession is a front-end for a session owned by an I/O thread. Application
+// threads Write into a bounded MPSC queue and Read from a bounded SPSC queue, the
+// I/O thread moves messages between the queues and kcp. Each side wakes the other
+// through an eventfd, at most once until the other side has caught up, so neither
+// side ever takes a lock the other one holds.
+class ThreadedSession {
+public:
+    ThreadedSession(const ThreadedSession &) = delete;
+
+    ThreadedSession &operator=(const ThreadedSession &) = delete;
+
+    // Create takes ownership of "sess", call it on the I/O thread.
+    // "depth" bounds the messages queued in each direction.
+    static ThreadedSession *Create(UDPSession *sess, size_t depth);
+
+    // Destroy release all resource related, the session included. Call it on the
+    // I/O thread once no application thread uses the front-end any more.
+    static void Destroy(ThreadedSession *ts);
+
+    // Write queues a copy of the message for the I/O thread, any thread may call it.
+    // Returns -1 if the queue is full, -2 if the message is larger than the session
+    // takes (see UDPSession::MaxMessage). The I/O thread hands queued messages to kcp
+    // while its send window has room, so a full queue is the backpressure of a slow
+    // or congested peer.
+    ssize_t Write(const char *buf, size_t sz) noexcept;
+
+    // WriteErrors returns the messages Write accepted but kcp refused later, e.g. when
+    // the mtu shrank in between. They are dropped.
+    inline uint64_t WriteErrors() const noexcept { return m_writeErrs.load(std::memory_order_relaxed); }
+
+    // Read copies the next received message into "buf", one reader thread at a time.
+    // Returns 0 if there is none, a message larger than "sz" takes several Reads.
+    ssize_t Read(char *buf, size_t sz) noexcept;
+
+    // ReadFd polls readable while messages wait for Read.
+    inline int ReadFd() const noexcept { return m_readfd; }
+
+    // Session returns the underlying session, only the I/O thread may touch it.
+    inline UDPSession *Session() const noexcept { return m_sess; }
+
+    // Fd polls readable when the I/O thread has work, EventLoop::Add watches it.
+    inline int Fd() const noexcept { return m_iofd; }
+
+    // Pump hands queued writes to kcp and received messages to the reader. EventLoop
+    // does it by itself, I/O threads driving the session with Update call it after Update.
+    void Pump() noexcept;
+
+private:
+    ThreadedSession() = default;
+
+    ~ThreadedSession() = default;
+
+    struct message {
+        char *data;
+        size_t len;
+    };
+
+    // drain moves queued writes into kcp while the send window has room
+    void drain() noexcept;
+
+    // deliver moves received messages to the reader until its queue is full
+    void deliver() noexcept;
+
+    // wakeIO signals the I/O thread unless it was signalled and did not run yet
+    void wakeIO() noexcept;
+
+    static void signal(int fd) noexcept;
+
+    static void clear(int fd) noexcept;
+
+    UDPSession *m_sess{nullptr};
+    EventLoop *m_loop{nullptr};
+    MPSCQueue<message> *m_writes{nullptr};
+    SPSCQueue<message> *m_reads{nullptr};
+    size_t m_readoff{0};        // bytes of the front message already read
+
+    int m_iofd{-1};
+    int m_readfd{-1};
+    std::atomic<bool> m_ioSignalled{false};
+    std::atomic<bool> m_readSignalled{false};
+    std::atomic<bool> m_readBlocked{false};     // deliver stopped on a full queue
+    std::atomic<size_t> m_maxMessage{0};        // UDPSession::MaxMessage, refreshed by the I/O thread
+    std::atomic<uint64_t> m_writeErrs{0};
+
+    friend class EventLoop;
+};
+
+#endif //KCP_THREADED_H
@@ -0,0 +1,118 @@
+#include "transport.h"
+
+SocketTransport::SocketTransport(int sockfd) : m_sockfd(sockfd) {
+    m_rxbatch.Resize(defaultRecvBatch, recvBufSize);
+    m_txbatch.Resize(defaultSendBatch, sendBufSize);
+    m_rxbatch.SetOverflow(sockfd, true);
+}
+
+int
+SocketTransport::Recv(Datagram **dgrams, bool *more) noexcept {
+    int n = m_rxbatch.Recv(m_sockfd);
+    *dgrams = m_rxbatch.Datagrams();
+    *more = m_rxbatch.Full();
+    checkDrops();
+    return n;
+}
+
+bool
+SocketTransport::Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept {
+    if (m_txbatch.Full()) {
+        m_txbatch.Flush(m_sockfd);
+        checkDrops();
+    }
+    return m_txbatch.Push(buf, len, addr, addrlen);
+}
+
+int
+SocketTransport::Flush() noexcept {
+    int n = m_txbatch.Flush(m_sockfd);
+    checkDrops();
+    return n;
+}
+
+void
+SocketTransport::checkDrops() noexcept {
+    if (m_rxbatch.Drops() != m_rxDrops) {
+        m_rxDrops = m_rxbatch.Drops();
+        if (!m_rxFull) {
+            m_rxFull = !growBuf(SO_RCVBUF);
+        }
+    }
+    // only a full send buffer calls for a larger one, not e.g. an oversized probe
+    m_txDrops = m_txbatch.Drops();
+    if (m_txbatch.FullDrops() != m_txFullDrops) {
+        m_txFullDrops = m_txbatch.FullDrops();
+        if (!m_txFull) {
+            m_txFull = !growBuf(SO_SNDBUF);
+        }
+    }
+}
+
+bool
+SocketTransport::growBuf(int opt) noexcept {
+    // the kernel reports (and reserves) twice the size set
+    int cur = 0;
+    socklen_t len = sizeof(cur);
+    if (getsockopt(m_sockfd, SOL_SOCKET, opt, &cur, &len) < 0 || size_t(cur) >= m_sockBufMax) {
+        return false;
+    }
+
+    size_t want = size_t(cur) * 2 < m_sockBufMax ? size_t(cur) * 2 : m_sockBufMax;
+    int val = int(want / 2);
+#if defined(SO_RCVBUFFORCE) && defined(SO_SNDBUFFORCE)
+    // past net.core.rmem_max/wmem_max with CAP_NET_ADMIN
+    int force = opt == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+    if (setsockopt(m_sockfd, SOL_SOCKET, force, &val, sizeof(val)) < 0) {
+        setsockopt(m_sockfd, SOL_SOCKET, opt, &val, sizeof(val));
+    }
+#else
+    setsockopt(m_sockfd, SOL_SOCKET, opt, &val, sizeof(val));
+#endif
+
+    int now = 0;
+    len = sizeof(now);
+    return getsockopt(m_sockfd, SOL_SOCKET, opt, &now, &len) == 0 && now > cur;
+}
+
+void
+SocketTransport::SetRecvBatch(size_t n) noexcept {
+    m_rxbatch.Resize(n, m_rxbatch.BufSize());
+}
+
+int
+SocketTransport::SetGRO(bool enable) noexcept {
+    int ret = m_rxbatch.SetGRO(m_sockfd, enable);
+    if (ret == 0 && m_rxbatch.BufSize() < m_maxDatagram) {
+        m_rxbatch.Resize(m_rxbatch.Size(), m_maxDatagram);
+    }
+    return ret;
+}
+
+void
+SocketTransport::SetGSO(bool enable) noexcept {
+    m_txbatch.SetGSO(enable);
+}
+
+int
+SocketTransport::SetTimestamps(bool enable) noexcept {
+    return m_rxbatch.SetTimestamps(m_sockfd, enable);
+}
+
+size_t
+SocketTransport::MaxDatagram(size_t n) noexcept {
+    if (n > gsoMaxBytes) {
+        n = gsoMaxBytes;
+    }
+    if (n > m_maxDatagram) {
+        m_maxDatagram = n;
+    }
+    if (m_rxbatch.BufSize() < n) {
+        m_rxbatch.Resize(m_rxbatch.Size(), n);
+    }
+    if (m_txbatch.BufSize() < n) {
+        m_txbatch.Flush(m_sockfd);
+        m_txbatch.Resize(m_txbatch.Size(), n);
+    }
+    return n;
+}
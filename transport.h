@@ -0,0 +1,110 @@
+#ifndef KCP_TRANSPORT_H
+#define KCP_TRANSPORT_H
+
+#include "batch.h"
+
+const size_t defaultSockBufMax = 4 << 20;   // SO_RCVBUF/SO_SNDBUF grow up to this on drops
+
+// Transport moves datagrams between sessions and the network. UDPSession and
+// UDPListener only talk to a Transport, so the I/O backend can be swapped
+// without touching FEC or kcp.
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    // Recv reads pending datagrams without blocking. "*dgrams" points at an array which
+    // stays valid until the next Recv, "*more" is set if more datagrams may be pending.
+    virtual int Recv(Datagram **dgrams, bool *more) noexcept = 0;
+
+    // Send queues one datagram, "addr" is nullptr on connected transports.
+    // Returns false if the datagram was dropped.
+    virtual bool Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept = 0;
+
+    // Flush hands every queued datagram to the network, returns how many were accepted.
+    virtual int Flush() noexcept = 0;
+
+    // Fd returns a descriptor which polls readable when Recv has work, -1 if there is none.
+    virtual int Fd() const noexcept = 0;
+
+    // tuning knobs, transports which don't support them ignore them or return -1
+    virtual void SetRecvBatch(size_t n) noexcept { (void) n; }
+
+    virtual int SetGRO(bool enable) noexcept { (void) enable; return -1; }
+
+    virtual void SetGSO(bool enable) noexcept { (void) enable; }
+
+    virtual int SetTimestamps(bool enable) noexcept { (void) enable; return -1; }
+
+    // MaxDatagram makes room for datagrams of up to "n" bytes in both directions and
+    // returns the largest size the transport carries, which may be less than "n".
+    virtual size_t MaxDatagram(size_t n) noexcept { return n < recvBufSize ? n : recvBufSize; }
+
+    // RxDrops returns the datagrams dropped on this host before Recv got them, e.g. on a
+    // full socket receive queue, TxDrops the ones the host refused to send. Neither was
+    // lost on the wire. Transports which can't tell report 0.
+    virtual uint64_t RxDrops() const noexcept { return 0; }
+
+    virtual uint64_t TxDrops() const noexcept { return 0; }
+
+    // SetSockBufMax caps the socket buffers grown on local drops at "max" bytes, 0 stops growing them.
+    virtual void SetSockBufMax(size_t max) noexcept { (void) max; }
+};
+
+// SocketTransport is the default backend: recvmmsg/sendmmsg on a udp socket,
+// with optional GRO and GSO. The socket is owned by the caller.
+// Receive queue overflows are counted with SO_RXQ_OVFL. Whenever the kernel drops
+// datagrams on a full receive queue or a full send buffer (EAGAIN, ENOBUFS), the
+// buffer concerned is doubled up to SetSockBufMax. Datagrams refused for themselves,
+// e.g. an oversized probe with EMSGSIZE, count in TxDrops but don't grow it.
+class SocketTransport : public Transport {
+public:
+    explicit SocketTransport(int sockfd);
+
+    int Recv(Datagram **dgrams, bool *more) noexcept override;
+
+    bool Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept override;
+
+    int Flush() noexcept override;
+
+    inline int Fd() const noexcept override { return m_sockfd; }
+
+    void SetRecvBatch(size_t n) noexcept override;
+
+    int SetGRO(bool enable) noexcept override;
+
+    void SetGSO(bool enable) noexcept override;
+
+    int SetTimestamps(bool enable) noexcept override;
+
+    size_t MaxDatagram(size_t n) noexcept override;
+
+    inline uint64_t RxDrops() const noexcept override { return m_rxbatch.Drops(); }
+
+    inline uint64_t TxDrops() const noexcept override { return m_txbatch.Drops(); }
+
+    inline void SetSockBufMax(size_t max) noexcept override {
+        m_sockBufMax = max;
+        m_rxFull = m_txFull = false;
+    }
+
+private:
+    // checkDrops grows the buffer of a direction which dropped datagrams since the last call.
+    void checkDrops() noexcept;
+
+    // growBuf doubles SO_RCVBUF or SO_SNDBUF ("opt") up to m_sockBufMax, returns false
+    // once it can't grow any further.
+    bool growBuf(int opt) noexcept;
+
+    int m_sockfd;
+    size_t m_sockBufMax{defaultSockBufMax};
+    uint64_t m_rxDrops{0};  // drops seen by checkDrops
+    uint64_t m_txDrops{0};
+    uint64_t m_txFullDrops{0};  // drops for want of send buffer space
+    bool m_rxFull{false};   // SO_RCVBUF reached its limit
+    bool m_txFull{false};
+    size_t m_maxDatagram{recvBufSize};  // kept when GRO is switched off
+    RecvBatch m_rxbatch;
+    SendBatch m_txbatch;    // sent on Flush, or earlier when full
+};
+
+#endif //KCP_TRANSPORT_H
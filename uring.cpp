@@ -0,0 +1,430 @@
+#include "uring.h"
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+
+// user_data of the requests which are not sends, sends carry their slot index
+static const uint64_t uringRecvTag = ~uint64_t(0);
+static const uint64_t uringCancelTag = ~uint64_t(0) - 1;
+static const uint16_t uringBufGroup = 0;
+
+UringTransport *
+UringTransport::Create(int sockfd, unsigned entries, bool sqpoll) {
+    if (entries == 0) {
+        return nullptr;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // every receive buffer and every send slot may have a completion outstanding
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = uringSQIdle;
+    }
+
+    int fd = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    UringTransport *io = new(UringTransport);
+    io->m_sockfd = sockfd;
+    io->m_ringfd = fd;
+    io->m_sqpoll = sqpoll;
+
+    io->m_sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->m_cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        io->m_sqringsz = io->m_sqringsz > io->m_cqringsz ? io->m_sqringsz : io->m_cqringsz;
+        io->m_cqringsz = 0;
+    }
+
+    void *sq = mmap(nullptr, io->m_sqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        io->m_sqringsz = 0;
+        delete io;
+        return nullptr;
+    }
+    io->m_sqring = sq;
+
+    void *cq = sq;
+    if (!single) {
+        cq = mmap(nullptr, io->m_cqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            io->m_cqringsz = 0;
+            delete io;
+            return nullptr;
+        }
+        io->m_cqring = cq;
+    }
+
+    io->m_sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, io->m_sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        io->m_sqessz = 0;
+        delete io;
+        return nullptr;
+    }
+    io->m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    auto sqbase = static_cast<char *>(sq);
+    io->m_sqhead = reinterpret_cast<unsigned *>(sqbase + p.sq_off.head);
+    io->m_sqtail = reinterpret_cast<unsigned *>(sqbase + p.sq_off.tail);
+    io->m_sqflags = reinterpret_cast<unsigned *>(sqbase + p.sq_off.flags);
+    io->m_sqarray = reinterpret_cast<unsigned *>(sqbase + p.sq_off.array);
+    io->m_sqmask = *reinterpret_cast<unsigned *>(sqbase + p.sq_off.ring_mask);
+    io->m_sqentries = p.sq_entries;
+    io->m_sqlocal = io->m_sqsubmitted = *io->m_sqtail;
+
+    auto cqbase = static_cast<char *>(cq);
+    io->m_cqhead = reinterpret_cast<unsigned *>(cqbase + p.cq_off.head);
+    io->m_cqtail = reinterpret_cast<unsigned *>(cqbase + p.cq_off.tail);
+    io->m_cqmask = *reinterpret_cast<unsigned *>(cqbase + p.cq_off.ring_mask);
+    io->m_cqes = reinterpret_cast<struct io_uring_cqe *>(cqbase + p.cq_off.cqes);
+
+    // provided buffer ring, sq_entries is a power of two as the ring requires.
+    // a buffer holds io_uring_recvmsg_out, the source address and the payload.
+    io->m_nbufs = p.sq_entries;
+    io->m_brsz = io->m_nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(nullptr, io->m_brsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) {
+        io->m_brsz = 0;
+        delete io;
+        return nullptr;
+    }
+    io->m_br = static_cast<struct io_uring_buf_ring *>(br);
+
+    io->m_bufsz = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + recvBufSize;
+    io->m_bufs = new byte[io->m_nbufs * io->m_bufsz];
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = uint64_t(uintptr_t(br));
+    reg.ring_entries = io->m_nbufs;
+    reg.bgid = uringBufGroup;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        delete io;
+        return nullptr;
+    }
+    for (unsigned i = 0; i < io->m_nbufs; i++) {
+        io->provide(uint16_t(i));
+    }
+    io->commit();
+
+    // with buffer select only the lengths matter, the kernel lays out every buffer as
+    // [io_uring_recvmsg_out] [msg_namelen bytes of address] [payload]
+    io->m_rxmsg.msg_namelen = sizeof(struct sockaddr_storage);
+
+    io->m_slots.resize(p.sq_entries);
+    io->m_freeSlots.reserve(p.sq_entries);
+    for (size_t i = io->m_slots.size(); i > 0; i--) {
+        io->m_freeSlots.push_back(uint32_t(i - 1));
+    }
+
+    io->arm();
+    if (io->submit() < 0) {
+        delete io;
+        return nullptr;
+    }
+    return io;
+}
+
+UringTransport::~UringTransport() {
+    if (m_ringfd >= 0 && m_sqes != nullptr && m_cqes != nullptr) {
+        // the kernel must be done with our buffers before they are freed:
+        // cancel the receive and wait for every send still in flight.
+        if (m_armed) {
+            struct io_uring_sqe *sqe = getSqe();
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = uringRecvTag;
+                sqe->user_data = uringCancelTag;
+            }
+        }
+        submit();
+        while (m_armed || m_freeSlots.size() < m_slots.size()) {
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                break;
+            }
+            reap(m_ready, m_readyBids, size_t(-1));
+        }
+    }
+
+    if (m_ringfd >= 0) { close(m_ringfd); }
+    if (m_br != nullptr) { munmap(m_br, m_brsz); }
+    if (m_sqes != nullptr) { munmap(m_sqes, m_sqessz); }
+    if (m_cqring != nullptr) { munmap(m_cqring, m_cqringsz); }
+    if (m_sqring != nullptr) { munmap(m_sqring, m_sqringsz); }
+    delete[] m_bufs;
+}
+
+int
+UringTransport::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) noexcept {
+    return int(syscall(__NR_io_uring_enter, m_ringfd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+struct io_uring_sqe *
+UringTransport::getSqe() noexcept {
+    unsigned head = __atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE);
+    if (m_sqlocal - head >= m_sqentries) {
+        return nullptr;
+    }
+
+    unsigned idx = m_sqlocal & m_sqmask;
+    struct io_uring_sqe *sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqarray[idx] = idx;
+    m_sqlocal++;
+    return sqe;
+}
+
+int
+UringTransport::submit() noexcept {
+    unsigned n = m_sqlocal - m_sqsubmitted;
+    if (n == 0) {
+        return 0;
+    }
+    __atomic_store_n(m_sqtail, m_sqlocal, __ATOMIC_RELEASE);
+    m_sqsubmitted = m_sqlocal;
+
+    if (m_sqpoll) {
+        // the poller thread picks the entries up by itself unless it went to sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(m_sqflags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return int(n);
+    }
+
+    for (;;) {
+        int ret = enter(n, 0, 0);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+void
+UringTransport::arm() noexcept {
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == nullptr) {
+        submit();
+        if ((sqe = getSqe()) == nullptr) {
+            return; // retried on the next Recv
+        }
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = m_sockfd;
+    sqe->addr = uint64_t(uintptr_t(&m_rxmsg));
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uringBufGroup;
+    sqe->user_data = uringRecvTag;
+    m_armed = true;
+}
+
+void
+UringTransport::provide(uint16_t bid) noexcept {
+    // only addr, len and bid may be written, the resv field of entry 0 is the ring tail.
+    // entries are indexed from the ring base: in C++ the uapi flex array "bufs" sits
+    // behind an empty struct and lands at offset 8.
+    struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(m_br) + (m_brtail & (m_nbufs - 1));
+    buf->addr = uint64_t(uintptr_t(m_bufs + size_t(bid) * m_bufsz));
+    buf->len = uint32_t(m_bufsz);
+    buf->bid = bid;
+    m_brtail++;
+}
+
+void
+UringTransport::commit() noexcept {
+    __atomic_store_n(&m_br->tail, m_brtail, __ATOMIC_RELEASE);
+}
+
+bool
+UringTransport::cqEmpty() const noexcept {
+    return *m_cqhead == __atomic_load_n(m_cqtail, __ATOMIC_ACQUIRE);
+}
+
+void
+UringTransport::reap(std::vector<Datagram> &dgrams, std::vector<uint16_t> &bids, size_t limit) noexcept {
+    unsigned head = *m_cqhead;
+    unsigned tail = __atomic_load_n(m_cqtail, __ATOMIC_ACQUIRE);
+    bool recycled = false;
+
+    for (; head != tail && dgrams.size() < limit; head++) {
+        const struct io_uring_cqe *cqe = &m_cqes[head & m_cqmask];
+        if (cqe->user_data == uringCancelTag) {
+            continue;
+        }
+        if (cqe->user_data != uringRecvTag) {
+            // a send completed, udp errors are dropped datagrams just like sendmmsg
+            m_freeSlots.push_back(uint32_t(cqe->user_data));
+            continue;
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            m_armed = false;    // e.g. -ENOBUFS when all buffers are taken
+        }
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        uint16_t bid = uint16_t(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        byte *buf = m_bufs + size_t(bid) * m_bufsz;
+        auto out = reinterpret_cast<struct io_uring_recvmsg_out *>(buf);
+        if (cqe->res < 0 || (out->flags & MSG_TRUNC) || out->namelen > m_rxmsg.msg_namelen) {
+            provide(bid);
+            recycled = true;
+            continue;
+        }
+
+        Datagram d;
+        d.addr = reinterpret_cast<const struct sockaddr *>(buf + sizeof(*out));
+        d.addrlen = out->namelen;
+        d.data = buf + sizeof(*out) + m_rxmsg.msg_namelen + m_rxmsg.msg_controllen;
+        d.len = out->payloadlen;
+        d.stamp = 0;
+        dgrams.push_back(d);
+        bids.push_back(bid);
+    }
+
+    __atomic_store_n(m_cqhead, head, __ATOMIC_RELEASE);
+    if (recycled) {
+        commit();
+    }
+}
+
+int
+UringTransport::Recv(Datagram **dgrams, bool *more) noexcept {
+    // the caller is done with the previous batch
+    for (auto bid : m_outBids) {
+        provide(bid);
+    }
+    if (!m_outBids.empty()) {
+        commit();
+    }
+    m_out.clear();
+    m_outBids.clear();
+    m_out.swap(m_ready);
+    m_outBids.swap(m_readyBids);
+
+    // completions which did not fit in the cq ring are only flushed by the kernel on enter
+    if (__atomic_load_n(m_sqflags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+        enter(0, 0, IORING_ENTER_GETEVENTS);
+    }
+
+    reap(m_out, m_outBids, m_batch);
+    if (!m_armed) {
+        arm();
+        submit();
+    }
+
+    *dgrams = m_out.data();
+    *more = !cqEmpty();
+    return int(m_out.size());
+}
+
+bool
+UringTransport::Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept {
+    if (len > sendBufSize || addrlen > sizeof(struct sockaddr_storage)) {
+        return false;
+    }
+
+    // all slots in flight, received datagrams met on the way are kept for Recv
+    while (m_freeSlots.empty()) {
+        reap(m_ready, m_readyBids, size_t(-1));
+        if (!m_freeSlots.empty()) {
+            break;
+        }
+        submit();
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == nullptr) {
+        submit();
+        if ((sqe = getSqe()) == nullptr) {
+            return false;
+        }
+    }
+
+    uint32_t idx = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    sendSlot &slot = m_slots[idx];
+    memcpy(slot.buf, buf, len);
+    slot.iov.iov_base = slot.buf;
+    slot.iov.iov_len = len;
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+    if (addr != nullptr) {
+        memcpy(&slot.addr, addr, addrlen);
+        slot.msg.msg_name = &slot.addr;
+        slot.msg.msg_namelen = addrlen;
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = m_sockfd;
+    sqe->addr = uint64_t(uintptr_t(&slot.msg));
+    sqe->user_data = idx;
+    return true;
+}
+
+int
+UringTransport::Flush() noexcept {
+    return submit();
+}
+
+void
+UringTransport::SetRecvBatch(size_t n) noexcept {
+    if (n > 0) {
+        m_batch = n;
+    }
+}
+
+#else
+
+UringTransport *
+UringTransport::Create(int sockfd, unsigned entries, bool sqpoll) {
+    (void) sockfd;
+    (void) entries;
+    (void) sqpoll;
+    return nullptr;
+}
+
+UringTransport::~UringTransport() {}
+
+int UringTransport::Recv(Datagram **dgrams, bool *more) noexcept {
+    *dgrams = nullptr;
+    *more = false;
+    return 0;
+}
+
+bool UringTransport::Send(const void *, size_t, const struct sockaddr *, socklen_t) noexcept { return false; }
+
+int UringTransport::Flush() noexcept { return 0; }
+
+void UringTransport::SetRecvBatch(size_t n) noexcept { (void) n; }
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef KCP_URING_H
+#define KCP_URING_H
+
+#include "transport.h"
+#include <stdint.h>
+#include <vector>
+
+const unsigned defaultUringEntries = 256;   // submission queue size, also the number of receive buffers
+const unsigned uringSQIdle = 1000;          // ms the SQPOLL thread spins before it sleeps
+
+// UringTransport is an io_uring backend. Receiving is one multishot recvmsg which
+// keeps filling buffers from a provided buffer ring, so reading a batch is just
+// walking the completion queue. Sends are queued as sendmsg entries and handed
+// to the kernel with one io_uring_enter per Flush, or none at all with SQPOLL.
+class UringTransport : public Transport {
+public:
+    // Create sets up a ring with "entries" slots on "sockfd", which stays owned by the caller.
+    // Returns nullptr if the kernel lacks io_uring, provided buffer rings or multishot recvmsg.
+    static UringTransport *Create(int sockfd, unsigned entries, bool sqpoll);
+
+    ~UringTransport() override;
+
+    int Recv(Datagram **dgrams, bool *more) noexcept override;
+
+    bool Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept override;
+
+    int Flush() noexcept override;
+
+    // Fd is the ring itself, it polls readable while completions are pending.
+    inline int Fd() const noexcept override { return m_ringfd; }
+
+    void SetRecvBatch(size_t n) noexcept override;
+
+private:
+    UringTransport() = default;
+
+    struct sendSlot {
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_storage addr;
+        byte buf[sendBufSize];
+    };
+
+    struct io_uring_sqe *getSqe() noexcept;
+
+    int submit() noexcept;
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) noexcept;
+
+    // arm starts the multishot recvmsg, it is re-armed whenever the kernel ends it.
+    void arm() noexcept;
+
+    // provide gives a receive buffer back to the kernel, visible after the next commit.
+    void provide(uint16_t bid) noexcept;
+
+    void commit() noexcept;
+
+    // reap consumes up to "limit" datagrams worth of completions, received datagrams
+    // go to "dgrams" and their buffer ids to "bids".
+    void reap(std::vector<Datagram> &dgrams, std::vector<uint16_t> &bids, size_t limit) noexcept;
+
+    bool cqEmpty() const noexcept;
+
+    int m_sockfd{-1};
+    int m_ringfd{-1};
+    bool m_sqpoll{false};
+
+    // rings shared with the kernel
+    void *m_sqring{nullptr};
+    size_t m_sqringsz{0};
+    void *m_cqring{nullptr};
+    size_t m_cqringsz{0};
+    struct io_uring_sqe *m_sqes{nullptr};
+    size_t m_sqessz{0};
+    unsigned *m_sqhead{nullptr};
+    unsigned *m_sqtail{nullptr};
+    unsigned *m_sqflags{nullptr};
+    unsigned *m_sqarray{nullptr};
+    unsigned m_sqmask{0};
+    unsigned m_sqentries{0};
+    unsigned m_sqlocal{0};      // tail including entries not published yet
+    unsigned m_sqsubmitted{0};  // tail as of the last submit
+    unsigned *m_cqhead{nullptr};
+    unsigned *m_cqtail{nullptr};
+    unsigned m_cqmask{0};
+    struct io_uring_cqe *m_cqes{nullptr};
+
+    // provided buffers for the multishot receive
+    struct io_uring_buf_ring *m_br{nullptr};
+    size_t m_brsz{0};
+    uint16_t m_brtail{0};
+    byte *m_bufs{nullptr};
+    size_t m_bufsz{0};
+    unsigned m_nbufs{0};
+    struct msghdr m_rxmsg{};
+    bool m_armed{false};
+
+    // datagrams returned by the last Recv, their buffers are recycled on the next one
+    std::vector<Datagram> m_out;
+    std::vector<uint16_t> m_outBids;
+    // datagrams reaped while waiting for a send slot, returned by the next Recv
+    std::vector<Datagram> m_ready;
+    std::vector<uint16_t> m_readyBids;
+    size_t m_batch{defaultRecvBatch};
+
+    std::vector<sendSlot> m_slots;
+    std::vector<uint32_t> m_freeSlots;
+};
+
+#endif //KCP_URING_H
@@ -0,0 +1,516 @@
+#include "xdp.h"
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static const uint32_t xdpMapEntries = 64;   // rx queues the XSKMAP can address
+
+static int
+sysBPF(int cmd, union bpf_attr *attr) noexcept {
+    return int(syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+static struct bpf_insn
+insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) noexcept {
+    struct bpf_insn i;
+    i.code = code;
+    i.dst_reg = dst;
+    i.src_reg = src;
+    i.off = off;
+    i.imm = imm;
+    return i;
+}
+
+static uint16_t
+ipChecksum(const byte *p, size_t n) noexcept {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        sum += uint32_t(p[i]) << 8 | p[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return uint16_t(~sum);
+}
+
+static uint64_t
+packMac(const uint8_t *mac) noexcept {
+    uint64_t v = 0;
+    memcpy(&v, mac, 6);
+    return v;
+}
+
+XdpTransport *
+XdpTransport::Create(int sockfd, const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) {
+    if (queue >= xdpMapEntries) {
+        return nullptr;
+    }
+
+    XdpTransport *xt = new(XdpTransport);
+    memcpy(xt->m_gwmac, gwmac, 6);
+    xt->m_addrs.resize(xt->m_batch);
+
+    // local address from the udp socket, the interface address if it is bound to any
+    socklen_t len = sizeof(xt->m_local);
+    if (getsockname(sockfd, (struct sockaddr *) &xt->m_local, &len) < 0 || xt->m_local.sin_family != AF_INET) {
+        delete xt;
+        return nullptr;
+    }
+    len = sizeof(xt->m_peer);
+    if (getpeername(sockfd, (struct sockaddr *) &xt->m_peer, &len) < 0) {
+        memset(&xt->m_peer, 0, sizeof(xt->m_peer));
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(sockfd, SIOCGIFHWADDR, &ifr) < 0) {
+        delete xt;
+        return nullptr;
+    }
+    memcpy(xt->m_mac, ifr.ifr_hwaddr.sa_data, 6);
+    if (xt->m_local.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        if (ioctl(sockfd, SIOCGIFADDR, &ifr) < 0) {
+            delete xt;
+            return nullptr;
+        }
+        xt->m_local.sin_addr = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
+    }
+    xt->m_ifindex = int(if_nametoindex(ifname));
+    if (xt->m_ifindex == 0) {
+        delete xt;
+        return nullptr;
+    }
+
+    xt->m_xsk = socket(AF_XDP, SOCK_RAW, 0);
+    if (xt->m_xsk < 0) {
+        delete xt;
+        return nullptr;
+    }
+
+    // UMEM
+    xt->m_umemsz = size_t(xdpFrames) * xdpFrameSize;
+    void *umem = mmap(nullptr, xt->m_umemsz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umem == MAP_FAILED) {
+        xt->m_umemsz = 0;
+        delete xt;
+        return nullptr;
+    }
+    xt->m_umem = static_cast<byte *>(umem);
+
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = uint64_t(uintptr_t(umem));
+    reg.len = xt->m_umemsz;
+    reg.chunk_size = xdpFrameSize;
+    reg.headroom = 0;
+    int ringsz = int(xdpRingSize);
+    if (setsockopt(xt->m_xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xt->m_xsk, SOL_XDP, XDP_UMEM_FILL_RING, &ringsz, sizeof(ringsz)) < 0 ||
+        setsockopt(xt->m_xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringsz, sizeof(ringsz)) < 0 ||
+        setsockopt(xt->m_xsk, SOL_XDP, XDP_RX_RING, &ringsz, sizeof(ringsz)) < 0 ||
+        setsockopt(xt->m_xsk, SOL_XDP, XDP_TX_RING, &ringsz, sizeof(ringsz)) < 0) {
+        delete xt;
+        return nullptr;
+    }
+
+    struct xdp_mmap_offsets off;
+    len = sizeof(off);
+    if (getsockopt(xt->m_xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0 ||
+        xt->mapRing(xt->m_rx, XDP_PGOFF_RX_RING, off.rx, sizeof(struct xdp_desc)) < 0 ||
+        xt->mapRing(xt->m_tx, XDP_PGOFF_TX_RING, off.tx, sizeof(struct xdp_desc)) < 0 ||
+        xt->mapRing(xt->m_fill, XDP_UMEM_PGOFF_FILL_RING, off.fr, sizeof(uint64_t)) < 0 ||
+        xt->mapRing(xt->m_comp, XDP_UMEM_PGOFF_COMPLETION_RING, off.cr, sizeof(uint64_t)) < 0) {
+        delete xt;
+        return nullptr;
+    }
+
+    // first half of the UMEM receives, second half sends
+    xt->m_fillprod = *xt->m_fill.producer;
+    for (uint32_t i = 0; i < xdpFrames / 2; i++) {
+        xt->fill(uint64_t(i) * xdpFrameSize);
+    }
+    __atomic_store_n(xt->m_fill.producer, xt->m_fillprod, __ATOMIC_RELEASE);
+    for (uint32_t i = xdpFrames; i > xdpFrames / 2; i--) {
+        xt->m_txfree.push_back(uint64_t(i - 1) * xdpFrameSize);
+    }
+    xt->m_txprod = *xt->m_tx.producer;
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = uint32_t(xt->m_ifindex);
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP | (native ? XDP_ZEROCOPY : XDP_COPY);
+    if (bind(xt->m_xsk, (struct sockaddr *) &sxdp, sizeof(sxdp)) < 0) {
+        delete xt;
+        return nullptr;
+    }
+    xt->m_needWakeup = true;
+
+    if (xt->loadProgram(queue) < 0) {
+        delete xt;
+        return nullptr;
+    }
+
+    // the link detaches the program when it is closed
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = uint32_t(xt->m_prog);
+    attr.link_create.target_ifindex = uint32_t(xt->m_ifindex);
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    xt->m_link = sysBPF(BPF_LINK_CREATE, &attr);
+    if (xt->m_link < 0) {
+        delete xt;
+        return nullptr;
+    }
+    return xt;
+}
+
+XdpTransport::~XdpTransport() {
+    if (m_link >= 0) { close(m_link); }
+    if (m_prog >= 0) { close(m_prog); }
+    if (m_map >= 0) { close(m_map); }
+    if (m_xsk >= 0) { close(m_xsk); }
+    ring *rings[] = {&m_rx, &m_tx, &m_fill, &m_comp};
+    for (auto r : rings) {
+        if (r->map != nullptr) { munmap(r->map, r->mapsz); }
+    }
+    if (m_umem != nullptr) { munmap(m_umem, m_umemsz); }
+}
+
+int
+XdpTransport::mapRing(ring &r, uint64_t pgoff, const struct xdp_ring_offset &off, size_t descsz) noexcept {
+    size_t sz = off.desc + xdpRingSize * descsz;
+    void *p = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_xsk, off_t(pgoff));
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    auto base = static_cast<char *>(p);
+    r.map = p;
+    r.mapsz = sz;
+    r.producer = reinterpret_cast<uint32_t *>(base + off.producer);
+    r.consumer = reinterpret_cast<uint32_t *>(base + off.consumer);
+    r.flags = reinterpret_cast<uint32_t *>(base + off.flags);
+    r.desc = base + off.desc;
+    r.mask = xdpRingSize - 1;
+    return 0;
+}
+
+int
+XdpTransport::loadProgram(uint32_t queue) noexcept {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = xdpMapEntries;
+    m_map = sysBPF(BPF_MAP_CREATE, &attr);
+    if (m_map < 0) {
+        return -1;
+    }
+
+    uint32_t key = queue;
+    uint32_t value = uint32_t(m_xsk);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = uint32_t(m_map);
+    attr.key = uint64_t(uintptr_t(&key));
+    attr.value = uint64_t(uintptr_t(&value));
+    if (sysBPF(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        return -1;
+    }
+
+    // ipv4 udp to local ip:port -> bpf_redirect_map(xsks, rx_queue_index, XDP_PASS),
+    // anything else -> XDP_PASS. 16 bit and 32 bit loads are in network order, as
+    // are the constants they are compared with.
+    const int16_t pass = 22;
+    struct bpf_insn prog[] = {
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+            insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, 0, 0),   // data
+            insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_1, 4, 0),   // data_end
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+            insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, int32_t(xdpHeaderSize)),
+            insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, pass - 6, 0),
+            insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 12, 0),  // ethertype
+            insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, pass - 8, htons(0x0800)),
+            insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 14, 0),  // version, ihl
+            insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, pass - 10, 0x45),
+            insn(BPF_LDX | BPF_B | BPF_MEM, BPF_REG_5, BPF_REG_2, 23, 0),  // protocol
+            insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, pass - 12, IPPROTO_UDP),
+            insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_5, BPF_REG_2, 30, 0),  // daddr
+            insn(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, pass - 14, int32_t(m_local.sin_addr.s_addr)),
+            insn(BPF_LDX | BPF_H | BPF_MEM, BPF_REG_5, BPF_REG_2, 36, 0),  // dport
+            insn(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, pass - 16, m_local.sin_port),
+            insn(BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_6, 16, 0),  // rx_queue_index
+            insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, m_map),
+            insn(0, 0, 0, 0, 0),
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS),
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS),  // pass
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    static_assert(sizeof(prog) / sizeof(prog[0]) == 24, "XDP program jump offsets are stale");
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = uint64_t(uintptr_t(prog));
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = uint64_t(uintptr_t("Dual MIT/GPL"));
+    m_prog = sysBPF(BPF_PROG_LOAD, &attr);
+    return m_prog < 0 ? -1 : 0;
+}
+
+void
+XdpTransport::kick() noexcept {
+    // errors only mean the kernel is busy, it picks the frames up on its next pass
+    sendto(m_xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+}
+
+void
+XdpTransport::fill(uint64_t addr) noexcept {
+    static_cast<uint64_t *>(m_fill.desc)[m_fillprod & m_fill.mask] = addr;
+    m_fillprod++;
+}
+
+void
+XdpTransport::reclaim() noexcept {
+    uint32_t cons = *m_comp.consumer;
+    uint32_t prod = __atomic_load_n(m_comp.producer, __ATOMIC_ACQUIRE);
+    if (cons == prod) {
+        return;
+    }
+    for (; cons != prod; cons++) {
+        m_txfree.push_back(static_cast<uint64_t *>(m_comp.desc)[cons & m_comp.mask]);
+    }
+    __atomic_store_n(m_comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+bool
+XdpTransport::parse(const byte *frame, uint32_t len, Datagram *d, struct sockaddr_in *from) noexcept {
+    if (len < xdpHeaderSize || frame[12] != 0x08 || frame[13] != 0x00) {
+        return false;
+    }
+
+    const byte *ip = frame + 14;
+    size_t ihl = size_t(ip[0] & 0x0f) * 4;
+    if ((ip[0] >> 4) != 4 || ihl < 20 || ip[9] != IPPROTO_UDP || 14 + ihl + 8 > len) {
+        return false;
+    }
+    if (((ip[6] << 8 | ip[7]) & 0x3fff) != 0) {
+        return false;   // fragment
+    }
+
+    const byte *udp = ip + ihl;
+    size_t ulen = size_t(udp[4] << 8 | udp[5]);
+    if (ulen < 8 || 14 + ihl + ulen > len) {
+        return false;
+    }
+
+    memset(from, 0, sizeof(*from));
+    from->sin_family = AF_INET;
+    memcpy(&from->sin_addr, ip + 12, 4);
+    memcpy(&from->sin_port, udp, 2);
+    m_neigh[from->sin_addr.s_addr] = packMac(frame + 6);
+
+    d->data = const_cast<byte *>(udp + 8);
+    d->len = ulen - 8;
+    d->addr = (const struct sockaddr *) from;
+    d->addrlen = sizeof(*from);
+    d->stamp = 0;       // no kernel timestamps on AF_XDP
+    return true;
+}
+
+int
+XdpTransport::Recv(Datagram **dgrams, bool *more) noexcept {
+    // the caller is done with the previous batch
+    for (auto addr : m_outFrames) {
+        fill(addr);
+    }
+    m_outFrames.clear();
+    m_out.clear();
+
+    uint32_t cons = *m_rx.consumer;
+    uint32_t prod = __atomic_load_n(m_rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t n = prod - cons;
+    if (n > m_batch) {
+        n = uint32_t(m_batch);
+    }
+
+    auto desc = static_cast<const struct xdp_desc *>(m_rx.desc);
+    for (uint32_t i = 0; i < n; i++) {
+        const struct xdp_desc &rx = desc[(cons + i) & m_rx.mask];
+        uint64_t frame = rx.addr & ~uint64_t(xdpFrameSize - 1);
+        Datagram d;
+        if (parse(m_umem + rx.addr, rx.len, &d, &m_addrs[m_out.size()])) {
+            m_out.push_back(d);
+            m_outFrames.push_back(frame);
+        } else {
+            fill(frame);
+        }
+    }
+    __atomic_store_n(m_rx.consumer, cons + n, __ATOMIC_RELEASE);
+
+    if (*m_fill.producer != m_fillprod) {
+        __atomic_store_n(m_fill.producer, m_fillprod, __ATOMIC_RELEASE);
+        if (m_needWakeup && (__atomic_load_n(m_fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+            recvfrom(m_xsk, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+        }
+    }
+
+    *dgrams = m_out.data();
+    *more = prod - cons > n;
+    return int(m_out.size());
+}
+
+bool
+XdpTransport::Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept {
+    if (addr == nullptr) {
+        addr = (const struct sockaddr *) &m_peer;
+        addrlen = sizeof(m_peer);
+    }
+    if (addr->sa_family != AF_INET || addrlen < sizeof(struct sockaddr_in) || len + xdpHeaderSize > xdpFrameSize) {
+        return false;
+    }
+    auto dst = (const struct sockaddr_in *) addr;
+
+    if (m_txfree.empty()) {
+        reclaim();
+    }
+    if (m_txfree.empty() || m_txprod - __atomic_load_n(m_tx.consumer, __ATOMIC_ACQUIRE) >= xdpRingSize) {
+        Flush();
+        reclaim();
+        if (m_txfree.empty() || m_txprod - __atomic_load_n(m_tx.consumer, __ATOMIC_ACQUIRE) >= xdpRingSize) {
+            return false;
+        }
+    }
+
+    uint64_t frame = m_txfree.back();
+    m_txfree.pop_back();
+    byte *p = m_umem + frame;
+
+    // ethernet
+    auto neigh = m_neigh.find(dst->sin_addr.s_addr);
+    if (neigh != m_neigh.end()) {
+        memcpy(p, &neigh->second, 6);
+    } else {
+        memcpy(p, m_gwmac, 6);
+    }
+    memcpy(p + 6, m_mac, 6);
+    p[12] = 0x08;
+    p[13] = 0x00;
+
+    // ipv4, don't fragment
+    byte *ip = p + 14;
+    size_t total = 20 + 8 + len;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    ip[2] = byte(total >> 8);
+    ip[3] = byte(total);
+    ip[4] = byte(m_ipid >> 8);
+    ip[5] = byte(m_ipid);
+    m_ipid++;
+    ip[6] = 0x40;
+    ip[7] = 0;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    ip[10] = 0;
+    ip[11] = 0;
+    memcpy(ip + 12, &m_local.sin_addr, 4);
+    memcpy(ip + 16, &dst->sin_addr, 4);
+    uint16_t sum = ipChecksum(ip, 20);
+    ip[10] = byte(sum >> 8);
+    ip[11] = byte(sum);
+
+    // udp, the checksum is optional over ipv4
+    byte *udp = ip + 20;
+    memcpy(udp, &m_local.sin_port, 2);
+    memcpy(udp + 2, &dst->sin_port, 2);
+    udp[4] = byte((8 + len) >> 8);
+    udp[5] = byte(8 + len);
+    udp[6] = 0;
+    udp[7] = 0;
+    memcpy(udp + 8, buf, len);
+
+    auto &tx = static_cast<struct xdp_desc *>(m_tx.desc)[m_txprod & m_tx.mask];
+    tx.addr = frame;
+    tx.len = uint32_t(xdpHeaderSize + len);
+    tx.options = 0;
+    m_txprod++;
+    m_txpending++;
+    return true;
+}
+
+int
+XdpTransport::Flush() noexcept {
+    int n = int(m_txpending);
+    if (n == 0) {
+        return 0;
+    }
+
+    __atomic_store_n(m_tx.producer, m_txprod, __ATOMIC_RELEASE);
+    m_txpending = 0;
+    if (!m_needWakeup || (__atomic_load_n(m_tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+        kick();
+    }
+    reclaim();
+    return n;
+}
+
+void
+XdpTransport::SetRecvBatch(size_t n) noexcept {
+    if (n > 0) {
+        m_batch = n;
+        m_addrs.resize(n);
+    }
+}
+
+#else
+
+XdpTransport *
+XdpTransport::Create(int sockfd, const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native) {
+    (void) sockfd;
+    (void) ifname;
+    (void) queue;
+    (void) gwmac;
+    (void) native;
+    return nullptr;
+}
+
+XdpTransport::~XdpTransport() {}
+
+int XdpTransport::Recv(Datagram **dgrams, bool *more) noexcept {
+    *dgrams = nullptr;
+    *more = false;
+    return 0;
+}
+
+bool XdpTransport::Send(const void *, size_t, const struct sockaddr *, socklen_t) noexcept { return false; }
+
+int XdpTransport::Flush() noexcept { return 0; }
+
+void XdpTransport::SetRecvBatch(size_t n) noexcept { (void) n; }
+
+#endif
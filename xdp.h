@@ -0,0 +1,111 @@
+#ifndef KCP_XDP_H
+#define KCP_XDP_H
+
+#include "transport.h"
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <netinet/in.h>
+
+const uint32_t xdpFrameSize = 2048;     // one UMEM chunk, holds a full ethernet frame
+const uint32_t xdpFrames = 4096;        // UMEM chunks, half for receiving and half for sending
+const uint32_t xdpRingSize = 2048;      // entries of each of the rx, tx, fill and completion rings
+const size_t xdpHeaderSize = 14 + 20 + 8;   // ethernet + ipv4 without options + udp
+
+// XdpTransport bypasses the kernel udp stack with an AF_XDP socket. A small XDP
+// program redirects ipv4 udp frames for the local port on one rx queue into the
+// socket, everything else still goes to the kernel. Received payloads are handed
+// out where they lie in the UMEM, so they reach FEC and ikcp_input without a copy.
+// Sending writes the ethernet/ipv4/udp headers in front of the payload.
+// Only ipv4 is supported, and frames must not carry ip options or be fragmented.
+class XdpTransport : public Transport {
+public:
+    // Create attaches to queue "queue" of interface "ifname" and takes over the traffic
+    // of the udp socket "sockfd": its local address is what the XDP program matches,
+    // its peer (if connected) is the default destination. The socket stays open to keep
+    // the port reserved and is owned by the caller. Frames go to "gwmac" unless the
+    // destination was seen sending, then to the mac it was seen with.
+    // "native" attaches in driver mode with zero-copy, otherwise in generic mode, which
+    // works on any device (e.g. veth). Returns nullptr on failure.
+    static XdpTransport *Create(int sockfd, const char *ifname, uint32_t queue, const uint8_t gwmac[6], bool native);
+
+    ~XdpTransport() override;
+
+    int Recv(Datagram **dgrams, bool *more) noexcept override;
+
+    bool Send(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) noexcept override;
+
+    int Flush() noexcept override;
+
+    // Fd is the AF_XDP socket, it polls readable while the rx ring is not empty.
+    inline int Fd() const noexcept override { return m_xsk; }
+
+    void SetRecvBatch(size_t n) noexcept override;
+
+    // one frame per datagram
+    inline size_t MaxDatagram(size_t n) noexcept override {
+        return n < xdpFrameSize - xdpHeaderSize ? n : xdpFrameSize - xdpHeaderSize;
+    }
+
+private:
+    XdpTransport() = default;
+
+    // ring is the user side view of one of the four rings shared with the kernel.
+    struct ring {
+        uint32_t *producer;
+        uint32_t *consumer;
+        uint32_t *flags;
+        void *desc;
+        uint32_t mask;
+        void *map;
+        size_t mapsz;
+    };
+
+    int mapRing(ring &r, uint64_t pgoff, const struct xdp_ring_offset &off, size_t descsz) noexcept;
+
+    int loadProgram(uint32_t queue) noexcept;
+
+    // kick wakes the kernel up when the socket was bound with need_wakeup
+    void kick() noexcept;
+
+    // reclaim moves sent frames from the completion ring back to the free list
+    void reclaim() noexcept;
+
+    void fill(uint64_t addr) noexcept;
+
+    bool parse(const byte *frame, uint32_t len, Datagram *d, struct sockaddr_in *from) noexcept;
+
+    int m_xsk{-1};
+    int m_prog{-1};
+    int m_map{-1};
+    int m_link{-1};
+    int m_ifindex{0};
+    bool m_needWakeup{false};
+
+    byte *m_umem{nullptr};
+    size_t m_umemsz{0};
+    ring m_rx{};
+    ring m_tx{};
+    ring m_fill{};
+    ring m_comp{};
+    uint32_t m_fillprod{0};     // fill ring producer including entries not published yet
+    uint32_t m_txprod{0};       // tx ring producer including entries not published yet
+    uint32_t m_txpending{0};
+
+    uint8_t m_mac[6]{};
+    uint8_t m_gwmac[6]{};
+    struct sockaddr_in m_local{};
+    struct sockaddr_in m_peer{};    // default destination, zero if the socket is not connected
+    uint16_t m_ipid{0};
+    std::unordered_map<uint32_t, uint64_t> m_neigh;     // ipv4 address -> mac it was seen with
+
+    // datagrams returned by the last Recv, their frames are refilled on the next one
+    std::vector<Datagram> m_out;
+    std::vector<struct sockaddr_in> m_addrs;
+    std::vector<uint64_t> m_outFrames;
+    size_t m_batch{defaultRecvBatch};
+
+    std::vector<uint64_t> m_txfree;     // UMEM offsets of frames free for sending
+};
+
+#endif //KCP_XDP_H